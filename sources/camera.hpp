@@ -134,6 +134,13 @@ class Camera
 		return view;
 	}
 
+	glm::mat4 CalcView(Csp p, glm::vec3& pos)
+	{
+		glm::vec3 front = CalcDirFromYawPitch(p.Yaw(), p.Pitch());
+		pos = -p.BackOff() * 0.01f * front;
+		return glm::lookAt(pos, pos + front, cameraUp);
+	}
+
 	void SetTarget(YawPitch p)
 	{
 		cYaw->SetTarget(p.Yaw);
@@ -60,7 +60,7 @@ public:
 
 	cv::Point curCenterTarget;
 
-	cv::Mat dbgImg;
+	cv::Mat dbgImg; // With EnableDebugTexure, shown in place of the source, see GlFrameStream::UploadDebug
 
 	void TargetHistoryReset(int size) { targetHistoryLimit = size;  targetHistory.Reset(targetHistoryLimit); }
 
@@ -97,7 +97,8 @@ public:
 
 	cv::Mat crop2;
 
-	void Process(cv::Mat& crop)
+	// frames: source frames since the last call, so the history covers TrackAverageSecs of media time when frames are dropped
+	void Process(cv::Mat& crop, int frames = 1)
 	{
 		//auto crop = frame(cv::Rect(0, 0, frame.cols / 2, frame.rows));
 		cv::resize(crop, rgbReduce[gfc], cv::Size(FGSize, FGSize), 0, 0, cv::INTER_NEAREST);
@@ -119,7 +120,10 @@ public:
 				maxRgbDiff = maxRgbDiff2.clone();
 			}
 			cv::Mat diff;
-			cv::cvtColor(maxRgbDiff, diff, cv::COLOR_BGR2GRAY);
+			if (maxRgbDiff.channels() == 3)
+				cv::cvtColor(maxRgbDiff, diff, cv::COLOR_BGR2GRAY);
+			else
+				diff = maxRgbDiff; // Tracking on the Y plane of a YUV frame
 
 			diff -= minMotionThr;
 			diff *= 256;
@@ -171,12 +175,13 @@ public:
 				pitch *= pitch < 0 ? YOffAmpUp : YOffAmpDown;
 
 				curTarget = YawPitch(Limit(MaxYaw, yaw), Limit(MaxPitch, pitch));
-				targetHistory.Add(curTarget.ToPoint2f());
+				for (int i = 0; i < std::max(1, frames); i++)
+					targetHistory.Add(curTarget.ToPoint2f());
 				auto a = targetHistory.GetAverage();
 				curTarget = YawPitch(a);
 			}
 
-			if (EnableDebugTexure)
+			if (EnableDebugTexure && crop.channels() == 3)
 			{
 				cv::Mat mark = diff.clone();
 				mark = 0;
@@ -192,8 +197,6 @@ public:
 				channels[1] = diffUpscale;
 				channels[2] = markUpscale;
 				cv::merge(channels, dbgImg);
-				glPixelStorei(GL_UNPACK_ROW_LENGTH, dbgImg.cols);
-				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, dbgImg.cols, dbgImg.rows, 0, GL_BGR, GL_UNSIGNED_BYTE, dbgImg.data);
 			}
 		}
 
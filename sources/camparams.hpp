@@ -59,6 +59,8 @@ public:
 	float BackOff() { return _backOff; }
 	YawPitch YP() { return YawPitch(_yaw, _pitch); }
 
+	bool SameValues(const Csp& o) const { return _yaw == o._yaw && _pitch == o._pitch && _fov == o._fov && _backOff == o._backOff; }
+
 	bool IsEmpty() { return _setFlags == Cp::None; }
 	bool HasAll() { return _setFlags == Cp::All; }
 	bool HasYaw() { return IsSet(Cp::Yaw); }
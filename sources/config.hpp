@@ -53,8 +53,37 @@ ScriptBackgroundColor = 155,57,57;
 # Path to ffmpeg
 ffmpegPath = ffmpeg.exe
 
+############# Input video #############
+
+# VideoBackend: opencv or libav. libav decodes with libavformat/libavcodec directly (needs a build with UNVR_WITH_LIBAV):
+# it seeks to exact frames, uses the decoder's YUV 4:2:0 planes without copying them and has the thread settings below
+VideoBackend = opencv
+
+# DecodeThreads: libav decoder threads, 0 lets libavcodec decide. DecodeThreading: frame, slice or frame,slice
+DecodeThreads = 0
+DecodeThreading = frame,slice
+
+# KeyframeIndex: sidecar, memory or off. libav indexes the keyframes of the video on the first open, in the background,
+# so seeks go to the keyframe before the target and decode at most one GOP forward. sidecar keeps the index next to the
+# video as <video>.unvr.keyframes for the next open, memory scans each time
+KeyframeIndex = sidecar
+
 ############# Output video #############
 
+# OutBackend: opencv or libav. libav encodes with libavcodec/libavformat directly (needs a build with UNVR_WITH_LIBAV):
+# it takes i420 frames as is, has the encoder settings below, and with -saveaudio copies the source audio into the
+# output as it is written, so there is no ffmpeg pass afterwards. opencv uses OutFOURCC and OutQuality
+OutBackend = opencv
+
+# libav encoder settings. OutCrf and OutPreset are passed to encoders that have them (libx264, libx265, ...),
+# OutThreads = 0 lets libavcodec decide, OutGop (keyframe interval in frames) and OutBFrames = -1 keep the encoder default
+OutEncoder = libx264
+OutPreset = medium
+OutCrf = 20
+OutThreads = 0
+OutGop = -1
+OutBFrames = -1
+
 #OutFOURCC describes which codec the output video should be encoded with, like mp4v hvc1 XVID MP42 X264
 OutFOURCC = mp4v
 
@@ -64,6 +93,84 @@ OutExt = .mp4
 #OutQuality specifies quality (0..100%) of the encoded videostream
 #OutQuality = -1
 
+# Views: extra videos rendered from the same decoded frames with -save, each saved next to the main output as
+# <output>.<name>.mp4. name:yaw,pitch,fov,backoff is a fixed camera, name:track,fov,backoff follows the tracker like
+# the main view. Separate views with |, like front:0,0,65,0|wide:track,89,80. Needs Renderer = gl
+Views =
+
+############# Rendering #############
+
+# InputPixelFormat: i420 or bgr. i420 keeps the decoder's planar YUV 4:2:0 frames and converts to RGB while sampling,
+# falls back to bgr if the video backend can't deliver YUV
+InputPixelFormat = i420
+
+# InputYuvLayout: auto, i420 or nv12. How the opencv backend lays out the YUV frames it delivers, both have the same
+# size. auto asks the backend (OpenCV 4.5.2 and later) and falls back to bgr if it can't tell
+InputYuvLayout = auto
+
+# OutPixelFormat: bgr or i420. i420 converts to YUV while rendering (in the shader or cpu kernel) and reads back
+# 1.5 bytes per pixel instead of 3. Needs even Width and Height. The OpenCV video writer only takes BGR, so with it
+# frames are converted back before encoding, OutBackend = libav encodes them as is
+OutPixelFormat = bgr
+
+# Renderer: gl or cpu. cpu renders on the CPU with no window and no GL context, only used with -save without -view or -script
+Renderer = gl
+
+# GlContext: auto, window, hidden, egl or osmesa. For -save without -view or -script the gl renderer needs no window:
+# hidden uses an invisible window, egl a surfaceless EGL context with no window system at all (Mesa, needs a build
+# with UNVR_WITH_EGL, see README), osmesa GLFW's OSMesa context. hidden and osmesa still need an X or Wayland display.
+# auto is hidden for -save alone, or egl when there is no display or the hidden window fails, otherwise window
+GlContext = auto
+
+# GlProjection: analytic or mesh. analytic computes the exact source position per output pixel in the shader,
+# mesh draws the image on a sphere (or plane) mesh with one point per degree
+GlProjection = analytic
+
+# UploadRegion: visible or full. visible uploads only the part of each frame the camera can see (plus a margin),
+# full uploads the whole frame
+UploadRegion = visible
+
+# MaxTextureSize: largest texture the gl renderer uploads a frame to, 0 is the GPU's limit. Larger frames are split
+# into tiles with a one texel border. Set it below the frame size to try the tiled path on ordinary videos
+MaxTextureSize = 0
+
+# ReadbackLatency: frames the gl renderer keeps in flight before reading one back, so the GPU draws the next frame
+# while the previous is transferred. 0 reads back right after drawing, stalling until the GPU is done
+ReadbackLatency = 2
+
+# Playback: realtime or fast. With -view and no -save, realtime shows frames at their timestamps and skips converting
+# frames that would be shown late, fast shows every frame as fast as it can be rendered
+Playback = realtime
+
+# ShaderCache: folder where compiled shader programs are kept, so later runs skip compiling them. temp uses
+# unvrtool-shaders in the system temp folder, none disables the cache
+ShaderCache = temp
+
+# CpuKernel: auto, avx2, sse4, scalar or remap. auto picks the widest instruction set the cpu supports and computes
+# source coordinates per pixel. remap uses precomputed remap tables instead, which are cached as below
+CpuKernel = auto
+
+# RenderThreads: threads used by the cpu renderer, 0 uses one per hardware thread
+RenderThreads = 0
+
+# Remap tables for CpuKernel = remap are reused while the camera stays within RemapCacheStep (degrees) of a cached state.
+# RemapCacheMB limits memory used by cached tables, 0 disables the cache
+RemapCacheStep = 0.05
+RemapCacheMB = 256
+
+############# Pipeline #############
+
+# Frames queued for the stages around the render loop. The decoder runs up to DecodeQueueDepth frames ahead (at least
+# 1), each a full frame in memory. Tracking runs on each frame while it is drawn, and each output video is encoded on its
+# own thread while the next frames are drawn, the render loop only waits when an encoder is EncodeQueueDepth frames
+# behind. Deeper queues even out uneven frame times but hold more frames in memory, 0 runs the stage on the render thread
+DecodeQueueDepth = 2
+TrackQueueDepth = 1
+EncodeQueueDepth = 4
+
+# PrintStats: 1 prints the time per frame of each stage and the remap cache hits at exit
+PrintStats = 0
+
 ############# Tracking #############
 
 #TrackAverageSecs how many frames to average tracking over. Too few and camera gets jumpy, too many and it will be slow to respond to change
@@ -0,0 +1,143 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#include <cmath>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "cpu_kernels.hpp"
+
+// Scalar variant of the kernels, and runtime selection of the widest variant the CPU supports
+
+namespace CpuKernels
+{
+	namespace Scalar
+	{
+		struct VF { static const int N = 1; float v; };
+		struct VM { bool v; };
+
+		inline VF Set1(float a) { return { a }; }
+		inline VF Ramp(float a) { return { a }; }
+		inline VF operator+(VF a, VF b) { return { a.v + b.v }; }
+		inline VF operator-(VF a, VF b) { return { a.v - b.v }; }
+		inline VF operator*(VF a, VF b) { return { a.v * b.v }; }
+		inline VF operator/(VF a, VF b) { return { a.v / b.v }; }
+		inline VF Sqrt(VF a) { return { sqrtf(a.v) }; }
+		inline VF Abs(VF a) { return { fabsf(a.v) }; }
+		inline VF Min(VF a, VF b) { return { b.v < a.v ? b.v : a.v }; }
+		inline VF Max(VF a, VF b) { return { b.v > a.v ? b.v : a.v }; }
+		inline VM operator<(VF a, VF b) { return { a.v < b.v }; }
+		inline VM operator>(VF a, VF b) { return { a.v > b.v }; }
+		inline VM operator<=(VF a, VF b) { return { a.v <= b.v }; }
+		inline VM operator>=(VF a, VF b) { return { a.v >= b.v }; }
+		inline VM operator&(VM a, VM b) { return { a.v && b.v }; }
+		inline VF Select(VM m, VF a, VF b) { return m.v ? a : b; }
+
+		inline void StoreFixed(VF u, VF v, VM valid, int32_t* sx, int32_t* sy)
+		{
+			const float one = 1 << FixBits;
+			*sx = valid.v ? (int32_t)lrintf(u.v * one) : Invalid;
+			*sy = valid.v ? (int32_t)lrintf(v.v * one) : Invalid;
+		}
+	};
+};
+
+#define CPU_KERNELS_NS Scalar
+#include "cpu_kernels.inl"
+#undef CPU_KERNELS_NS
+
+namespace CpuKernels
+{
+	static bool CpuHas(Isa isa)
+	{
+#if defined(_MSC_VER)
+		int r[4];
+		__cpuid(r, 0);
+		int maxLeaf = r[0];
+		__cpuid(r, 1);
+		bool sse41 = (r[2] & (1 << 19)) != 0;
+		bool osxsave = (r[2] & (1 << 27)) != 0;
+		bool avx = (r[2] & (1 << 28)) != 0;
+		if (isa == Isa::Sse4) return sse41;
+		if (isa != Isa::Avx2 || !osxsave || !avx || maxLeaf < 7) return isa == Isa::Scalar;
+		if ((_xgetbv(0) & 6) != 6) return false; // OS saves ymm registers
+		__cpuidex(r, 7, 0);
+		return (r[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		if (isa == Isa::Sse4) return __builtin_cpu_supports("sse4.1");
+		if (isa == Isa::Avx2) return __builtin_cpu_supports("avx2");
+		return true;
+#else
+		return isa == Isa::Scalar;
+#endif
+	}
+
+	Isa Detect()
+	{
+		if (CpuHas(Isa::Avx2)) return Isa::Avx2;
+		if (CpuHas(Isa::Sse4)) return Isa::Sse4;
+		return Isa::Scalar;
+	}
+
+	Isa Parse(const std::string& s)
+	{
+		Isa best = Detect();
+		Isa isa = best;
+		if (s == "avx2") isa = Isa::Avx2;
+		if (s == "sse4") isa = Isa::Sse4;
+		if (s == "scalar") isa = Isa::Scalar;
+		return (int)isa > (int)best ? best : isa;
+	}
+
+	const char* Name(Isa isa)
+	{
+		switch (isa)
+		{
+		case Isa::Avx2: return "avx2";
+		case Isa::Sse4: return "sse4";
+		default: return "scalar";
+		}
+	}
+
+	template <class Src, class Dst>
+	static void Dispatch(Isa isa, VrImageGeometryMapping::Type type, const Params& p, const Src& src, bool wrapX,
+		Dst& dst, int x0, int y0, int x1, int y1, Background bg)
+	{
+		switch (isa)
+		{
+		case Isa::Avx2: Avx2::Render(type, p, src, wrapX, dst, x0, y0, x1, y1, bg); break;
+		case Isa::Sse4: Sse4::Render(type, p, src, wrapX, dst, x0, y0, x1, y1, bg); break;
+		default: Scalar::Render(type, p, src, wrapX, dst, x0, y0, x1, y1, bg); break;
+		}
+	}
+
+	void Render(Isa isa, VrImageGeometryMapping::Type type, const Params& p, const Image& src, bool wrapX,
+		Image& dst, int x0, int y0, int x1, int y1, Background bg)
+	{
+		Dispatch(isa, type, p, src, wrapX, dst, x0, y0, x1, y1, bg);
+	}
+
+	void Render(Isa isa, VrImageGeometryMapping::Type type, const Params& p, const Planes& src, bool wrapX,
+		Image& dst, int x0, int y0, int x1, int y1, Background bg)
+	{
+		Dispatch(isa, type, p, src, wrapX, dst, x0, y0, x1, y1, bg);
+	}
+
+	void Render(Isa isa, VrImageGeometryMapping::Type type, const Params& p, const Image& src, bool wrapX,
+		Planes& dst, int x0, int y0, int x1, int y1, Background bg)
+	{
+		Dispatch(isa, type, p, src, wrapX, dst, x0, y0, x1, y1, bg);
+	}
+
+	void Render(Isa isa, VrImageGeometryMapping::Type type, const Params& p, const Planes& src, bool wrapX,
+		Planes& dst, int x0, int y0, int x1, int y1, Background bg)
+	{
+		Dispatch(isa, type, p, src, wrapX, dst, x0, y0, x1, y1, bg);
+	}
+};
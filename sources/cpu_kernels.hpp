@@ -0,0 +1,75 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "vrimageformat.hpp"
+
+// Projection kernels computing the source coordinate of each output pixel on the fly (no remap table),
+// followed by bilinear sampling with fixed-point weights. One implementation, compiled once per instruction set.
+namespace CpuKernels
+{
+	enum class Isa { Scalar = 0, Sse4 = 1, Avx2 = 2 };
+
+	// Everything the kernels need from CpuProjection/Geometry, as plain floats
+	struct Params
+	{
+		float origin[3];
+		float dir0[3], dirX[3], dirY[3];
+		float rfx, rfy;
+		float planeAspectRatio;
+		float fisheyeX, fisheyeY, fisheyeW, fisheyeH;
+		float srcWidth, srcHeight;
+	};
+
+	// 8-bit image, BGR or a single plane
+	struct Image
+	{
+		uint8_t* data = nullptr;
+		size_t step = 0;
+		int width = 0, height = 0;
+	};
+
+	// 8-bit planar YUV 4:2:0, u and v are half size in both directions
+	struct Planes { Image y, u, v; };
+
+	struct Background { uint8_t b = 0, g = 0, r = 0; };
+
+	const int FixBits = 8; // Source coordinates are in 1/256 pixels
+	const int32_t Invalid = INT32_MIN;
+
+	Isa Detect();
+	Isa Parse(const std::string& s); // auto, avx2, sse4, scalar
+	const char* Name(Isa isa);
+
+	// Renders output pixels x0..x1-1, y0..y1-1 of dst. wrapX: source wraps horizontally (full 360 equirectangular)
+	void Render(Isa isa, VrImageGeometryMapping::Type type, const Params& p, const Image& src, bool wrapX,
+		Image& dst, int x0, int y0, int x1, int y1, Background bg);
+
+	// Same from a YUV source, and/or into I420 planes (x0, y0, x1, y1 even)
+	void Render(Isa isa, VrImageGeometryMapping::Type type, const Params& p, const Planes& src, bool wrapX,
+		Image& dst, int x0, int y0, int x1, int y1, Background bg);
+	void Render(Isa isa, VrImageGeometryMapping::Type type, const Params& p, const Image& src, bool wrapX,
+		Planes& dst, int x0, int y0, int x1, int y1, Background bg);
+	void Render(Isa isa, VrImageGeometryMapping::Type type, const Params& p, const Planes& src, bool wrapX,
+		Planes& dst, int x0, int y0, int x1, int y1, Background bg);
+
+	// Per instruction set entry points, implemented in cpu_kernels*.cpp
+#define CPU_KERNELS_DECL \
+	void Render(VrImageGeometryMapping::Type, const Params&, const Image&, bool, Image&, int, int, int, int, Background); \
+	void Render(VrImageGeometryMapping::Type, const Params&, const Planes&, bool, Image&, int, int, int, int, Background); \
+	void Render(VrImageGeometryMapping::Type, const Params&, const Image&, bool, Planes&, int, int, int, int, Background); \
+	void Render(VrImageGeometryMapping::Type, const Params&, const Planes&, bool, Planes&, int, int, int, int, Background);
+
+	namespace Scalar { CPU_KERNELS_DECL }
+	namespace Sse4 { CPU_KERNELS_DECL }
+	namespace Avx2 { CPU_KERNELS_DECL }
+
+#undef CPU_KERNELS_DECL
+};
@@ -0,0 +1,293 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Kernel implementation shared by cpu_kernels*.cpp. The including file defines CPU_KERNELS_NS and, inside that
+// namespace, the float vector VF (VF::N lanes) and mask VM with the operations used below.
+
+namespace CpuKernels
+{
+	namespace CPU_KERNELS_NS
+	{
+		using Type = VrImageGeometryMapping::Type;
+
+		// atan2 with a polynomial after reduction to [0, tan(pi/8)], max error about 1e-7 rad. Same ops in every ISA,
+		// so all variants give the same result
+		inline VF Atan2(VF y, VF x)
+		{
+			const float pi = 3.14159265358979f;
+			VF ax = Abs(x), ay = Abs(y);
+			VF mn = Min(ax, ay), mx = Max(ax, ay);
+			VF a = mn / Max(mx, Set1(1e-30f));
+
+			VM big = a > Set1(0.41421356f);
+			VF z = Select(big, (a - Set1(1)) / (a + Set1(1)), a);
+			VF zz = z * z;
+			VF r = (((Set1(8.05374449538e-2f) * zz - Set1(1.38776856032e-1f)) * zz + Set1(1.99777106478e-1f)) * zz - Set1(3.33329491539e-1f)) * zz * z + z;
+			r = Select(big, r + Set1(pi / 4), r);
+
+			r = Select(ay > ax, Set1(pi / 2) - r, r);
+			r = Select(x < Set1(0), Set1(pi) - r, r);
+			r = Select(y < Set1(0), Set1(0) - r, r);
+			return r;
+		}
+
+		// Source pixel coordinate (u,v) for ray direction d. Resolved per geometry at compile time
+		template <Type T>
+		inline void Project(const Params& p, VF dx, VF dy, VF dz, VF& u, VF& v, VM& valid)
+		{
+			VF ox = Set1(p.origin[0]), oy = Set1(p.origin[1]), oz = Set1(p.origin[2]);
+			VF px, py, pz;
+
+			if constexpr (T == Type::Flat)
+			{
+				VF t = (Set1(1) - oz) / dz;
+				valid = (dz > Set1(0)) & (t > Set1(0));
+				px = ox + t * dx;
+				py = oy + t * dy;
+				VF tx = (Set1(p.planeAspectRatio) - px) / Set1(2 * p.planeAspectRatio);
+				VF ty = (Set1(1) - py) * Set1(0.5f);
+				valid = valid & (tx >= Set1(0)) & (tx <= Set1(1)) & (ty >= Set1(0)) & (ty <= Set1(1));
+				u = tx * Set1(p.srcWidth) - Set1(0.5f);
+				v = ty * Set1(p.srcHeight) - Set1(0.5f);
+			}
+			else
+			{
+				// Unit sphere, camera inside: far root
+				float c = p.origin[0] * p.origin[0] + p.origin[1] * p.origin[1] + p.origin[2] * p.origin[2] - 1;
+				VF a = dx * dx + dy * dy + dz * dz;
+				VF b = ox * dx + oy * dy + oz * dz;
+				VF disc = b * b - a * Set1(c);
+				valid = disc >= Set1(0);
+				VF t = (Sqrt(Max(disc, Set1(0))) - b) / a;
+				px = ox + t * dx;
+				py = oy + t * dy;
+				pz = oz + t * dz;
+
+				VF rx = Atan2(Set1(0) - px, pz);
+				VF ry = Atan2(Set1(0) - py, Sqrt(px * px + pz * pz));
+				valid = valid & (Abs(rx) <= Set1(p.rfx)) & (Abs(ry) <= Set1(p.rfy));
+
+				if constexpr (T == Type::Fisheye)
+				{
+					// Orthographic model, as Geometry::GenerateSpherePoints
+					const float pi = 3.14159265358979f;
+					VF pxy = Sqrt(px * px + py * py);
+					VF an = Atan2(pxy, pz);
+					VF sc = Select(pxy > Set1(1e-6f), Set1(2 / pi) * an / Max(pxy, Set1(1e-6f)), Set1(2 / pi));
+					VF tx = (Set1(1) - px * sc) * Set1(0.5f);
+					VF ty = (Set1(1) - py * sc) * Set1(0.5f);
+					tx = Set1(p.fisheyeX) + tx * Set1(p.fisheyeW);
+					ty = Set1(p.fisheyeY) + ty * Set1(p.fisheyeH);
+					u = tx * Set1(p.srcWidth) - Set1(0.5f);
+					v = ty * Set1(p.srcHeight) - Set1(0.5f);
+				}
+				else
+				{
+					VF tx = (rx / Set1(p.rfx) + Set1(1)) * Set1(0.5f);
+					VF ty = (ry / Set1(p.rfy) + Set1(1)) * Set1(0.5f);
+					u = tx * Set1(p.srcWidth) - Set1(0.5f);
+					v = ty * Set1(p.srcHeight) - Set1(0.5f);
+				}
+			}
+		}
+
+		// Fixed-point source coordinates for output pixels x0..x1-1 of row y. sx/sy must hold x1-x0 rounded up to VF::N
+		template <Type T>
+		void RowCoords(const Params& p, int y, int x0, int x1, int32_t* sx, int32_t* sy)
+		{
+			float fy = (float)y;
+			VF rx = Set1(p.dir0[0] + fy * p.dirY[0]);
+			VF ry = Set1(p.dir0[1] + fy * p.dirY[1]);
+			VF rz = Set1(p.dir0[2] + fy * p.dirY[2]);
+			VF sxx = Set1(p.dirX[0]), sxy = Set1(p.dirX[1]), sxz = Set1(p.dirX[2]);
+
+			for (int x = x0; x < x1; x += VF::N, sx += VF::N, sy += VF::N)
+			{
+				VF fx = Ramp((float)x);
+				VF u, v;
+				VM valid;
+				Project<T>(p, rx + fx * sxx, ry + fx * sxy, rz + fx * sxz, u, v, valid);
+				StoreFixed(u, v, valid, sx, sy);
+			}
+		}
+
+		// Bilinear taps and weights (1/256) for fixed-point coordinate X,Y. Rows are clamped, columns wrap or clamp
+		struct Tap
+		{
+			int x0, x1, y0, y1, fx, fy;
+
+			Tap(int32_t X, int32_t Y, int w, int h, bool wrapX)
+			{
+				const int mask = (1 << FixBits) - 1;
+				x0 = X >> FixBits; fx = X & mask;
+				y0 = Y >> FixBits; fy = Y & mask;
+				x1 = x0 + 1; y1 = y0 + 1;
+				if (wrapX)
+				{
+					if (x0 < 0) x0 += w; else if (x0 >= w) x0 -= w;
+					if (x1 >= w) x1 -= w;
+				}
+				else
+				{
+					x0 = x0 < 0 ? 0 : (x0 >= w ? w - 1 : x0);
+					x1 = x1 < 0 ? 0 : (x1 >= w ? w - 1 : x1);
+				}
+				y0 = y0 < 0 ? 0 : (y0 >= h ? h - 1 : y0);
+				y1 = y1 < 0 ? 0 : (y1 >= h ? h - 1 : y1);
+			}
+
+			// Channel ch of an image with cn channels
+			int Sample(const Image& im, int cn, int ch) const
+			{
+				const int one = 1 << FixBits;
+				const uint8_t* r0 = im.data + y0 * im.step;
+				const uint8_t* r1 = im.data + y1 * im.step;
+				int top = r0[x0 * cn + ch] * (one - fx) + r0[x1 * cn + ch] * fx;
+				int bot = r1[x0 * cn + ch] * (one - fx) + r1[x1 * cn + ch] * fx;
+				return (top * (one - fy) + bot * fy + (1 << (2 * FixBits - 1))) >> (2 * FixBits);
+			}
+		};
+
+		inline void RowSample(const Image& src, bool wrapX, const int32_t* sx, const int32_t* sy, uint8_t* out, int n, Background bg)
+		{
+			for (int i = 0; i < n; i++, out += 3)
+			{
+				if (sx[i] == Invalid)
+				{
+					out[0] = bg.b; out[1] = bg.g; out[2] = bg.r;
+					continue;
+				}
+
+				Tap t(sx[i], sy[i], src.width, src.height, wrapX);
+				for (int ch = 0; ch < 3; ch++)
+					out[ch] = (uint8_t)t.Sample(src, 3, ch);
+			}
+		}
+
+		inline uint8_t Clamp8(int v) { return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v)); }
+
+		// Samples each plane, then converts to BGR with BT.601 limited range as cv::COLOR_YUV2BGR_I420
+		inline void RowSample(const Planes& src, bool wrapX, const int32_t* sx, const int32_t* sy, uint8_t* out, int n, Background bg)
+		{
+			const int quarter = 1 << (FixBits - 2);
+			for (int i = 0; i < n; i++, out += 3)
+			{
+				if (sx[i] == Invalid)
+				{
+					out[0] = bg.b; out[1] = bg.g; out[2] = bg.r;
+					continue;
+				}
+
+				// Chroma sample k is centered between luma samples 2k and 2k+1: xc = (x + 0.5) / 2 - 0.5
+				Tap ty(sx[i], sy[i], src.y.width, src.y.height, wrapX);
+				Tap tc((sx[i] >> 1) - quarter, (sy[i] >> 1) - quarter, src.u.width, src.u.height, wrapX);
+				int c = ty.Sample(src.y, 1, 0) - 16;
+				int d = tc.Sample(src.u, 1, 0) - 128;
+				int e = tc.Sample(src.v, 1, 0) - 128;
+				out[0] = Clamp8((298 * c + 516 * d + 128) >> 8);
+				out[1] = Clamp8((298 * c - 100 * d - 208 * e + 128) >> 8);
+				out[2] = Clamp8((298 * c + 409 * e + 128) >> 8);
+			}
+		}
+
+		template <Type T, class Src>
+		void RenderT(const Params& p, const Src& src, bool wrapX, Image& dst, int x0, int y0, int x1, int y1, Background bg)
+		{
+			int n = x1 - x0;
+			int padded = (n + VF::N - 1) / VF::N * VF::N;
+			thread_local std::vector<int32_t> sx, sy; // Render is called per tile, from many threads
+			if ((int)sx.size() < padded)
+			{
+				sx.resize(padded);
+				sy.resize(padded);
+			}
+
+			for (int y = y0; y < y1; y++)
+			{
+				RowCoords<T>(p, y, x0, x1, sx.data(), sy.data());
+				RowSample(src, wrapX, sx.data(), sy.data(), dst.data + y * dst.step + x0 * 3, n, bg);
+			}
+		}
+
+		// BT.601 limited range, as cv::COLOR_BGR2YUV_I420. Chroma from the average of each 2x2 block. n must be even
+		inline void BgrToI420Rows(const uint8_t* b0, const uint8_t* b1, int n, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v)
+		{
+			for (int i = 0; i < n; i++)
+			{
+				y0[i] = (uint8_t)(((66 * b0[3 * i + 2] + 129 * b0[3 * i + 1] + 25 * b0[3 * i] + 128) >> 8) + 16);
+				y1[i] = (uint8_t)(((66 * b1[3 * i + 2] + 129 * b1[3 * i + 1] + 25 * b1[3 * i] + 128) >> 8) + 16);
+			}
+			for (int i = 0; i < n / 2; i++, b0 += 6, b1 += 6)
+			{
+				int b = b0[0] + b0[3] + b1[0] + b1[3];
+				int g = b0[1] + b0[4] + b1[1] + b1[4];
+				int r = b0[2] + b0[5] + b1[2] + b1[5];
+				u[i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128);
+				v[i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 512) >> 10) + 128);
+			}
+		}
+
+		// I420 output: two rows at a time are rendered to BGR and converted while still in cache. Rect must be even aligned
+		template <Type T, class Src>
+		void RenderT(const Params& p, const Src& src, bool wrapX, Planes& dst, int x0, int y0, int x1, int y1, Background bg)
+		{
+			int n = x1 - x0;
+			int padded = (n + VF::N - 1) / VF::N * VF::N;
+			thread_local std::vector<int32_t> sx, sy;
+			thread_local std::vector<uint8_t> bgr;
+			if ((int)sx.size() < padded)
+			{
+				sx.resize(padded);
+				sy.resize(padded);
+				bgr.resize(2 * padded * 3);
+			}
+
+			for (int y = y0; y < y1; y += 2)
+			{
+				for (int k = 0; k < 2; k++)
+				{
+					RowCoords<T>(p, y + k, x0, x1, sx.data(), sy.data());
+					RowSample(src, wrapX, sx.data(), sy.data(), bgr.data() + k * n * 3, n, bg);
+				}
+				BgrToI420Rows(bgr.data(), bgr.data() + n * 3, n,
+					dst.y.data + y * dst.y.step + x0, dst.y.data + (y + 1) * dst.y.step + x0,
+					dst.u.data + (y / 2) * dst.u.step + x0 / 2, dst.v.data + (y / 2) * dst.v.step + x0 / 2);
+			}
+		}
+
+		template <class Src, class Dst>
+		void RenderSrc(Type type, const Params& p, const Src& src, bool wrapX, Dst& dst, int x0, int y0, int x1, int y1, Background bg)
+		{
+			switch (type)
+			{
+			case Type::Flat: RenderT<Type::Flat>(p, src, wrapX, dst, x0, y0, x1, y1, bg); break;
+			case Type::Equirectangular: RenderT<Type::Equirectangular>(p, src, wrapX, dst, x0, y0, x1, y1, bg); break;
+			case Type::Fisheye: RenderT<Type::Fisheye>(p, src, wrapX, dst, x0, y0, x1, y1, bg); break;
+			default: break;
+			}
+		}
+
+		void Render(Type type, const Params& p, const Image& src, bool wrapX, Image& dst, int x0, int y0, int x1, int y1, Background bg)
+		{
+			RenderSrc(type, p, src, wrapX, dst, x0, y0, x1, y1, bg);
+		}
+
+		void Render(Type type, const Params& p, const Planes& src, bool wrapX, Image& dst, int x0, int y0, int x1, int y1, Background bg)
+		{
+			RenderSrc(type, p, src, wrapX, dst, x0, y0, x1, y1, bg);
+		}
+
+		void Render(Type type, const Params& p, const Image& src, bool wrapX, Planes& dst, int x0, int y0, int x1, int y1, Background bg)
+		{
+			RenderSrc(type, p, src, wrapX, dst, x0, y0, x1, y1, bg);
+		}
+
+		void Render(Type type, const Params& p, const Planes& src, bool wrapX, Planes& dst, int x0, int y0, int x1, int y1, Background bg)
+		{
+			RenderSrc(type, p, src, wrapX, dst, x0, y0, x1, y1, bg);
+		}
+	};
+};
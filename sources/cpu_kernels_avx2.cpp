@@ -0,0 +1,65 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#include <cmath>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "cpu_kernels.hpp"
+
+// AVX2 variant of the kernels, 8 pixels per step. Only called if the CPU supports it (CpuKernels::Detect)
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC target("avx2")
+#elif defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#endif
+
+namespace CpuKernels
+{
+	namespace Avx2
+	{
+		struct VF { static const int N = 8; __m256 v; };
+		struct VM { __m256 v; };
+
+		inline VF Set1(float a) { return { _mm256_set1_ps(a) }; }
+		inline VF Ramp(float a) { return { _mm256_add_ps(_mm256_set1_ps(a), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)) }; }
+		inline VF operator+(VF a, VF b) { return { _mm256_add_ps(a.v, b.v) }; }
+		inline VF operator-(VF a, VF b) { return { _mm256_sub_ps(a.v, b.v) }; }
+		inline VF operator*(VF a, VF b) { return { _mm256_mul_ps(a.v, b.v) }; }
+		inline VF operator/(VF a, VF b) { return { _mm256_div_ps(a.v, b.v) }; }
+		inline VF Sqrt(VF a) { return { _mm256_sqrt_ps(a.v) }; }
+		inline VF Abs(VF a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v) }; }
+		inline VF Min(VF a, VF b) { return { _mm256_min_ps(a.v, b.v) }; }
+		inline VF Max(VF a, VF b) { return { _mm256_max_ps(a.v, b.v) }; }
+		inline VM operator<(VF a, VF b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+		inline VM operator>(VF a, VF b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+		inline VM operator<=(VF a, VF b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+		inline VM operator>=(VF a, VF b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+		inline VM operator&(VM a, VM b) { return { _mm256_and_ps(a.v, b.v) }; }
+		inline VF Select(VM m, VF a, VF b) { return { _mm256_blendv_ps(b.v, a.v, m.v) }; }
+
+		inline void StoreFixed(VF u, VF v, VM valid, int32_t* sx, int32_t* sy)
+		{
+			__m256 one = _mm256_set1_ps((float)(1 << FixBits));
+			__m256i inv = _mm256_set1_epi32(Invalid);
+			__m256i m = _mm256_castps_si256(valid.v);
+			__m256i x = _mm256_cvtps_epi32(_mm256_mul_ps(u.v, one));
+			__m256i y = _mm256_cvtps_epi32(_mm256_mul_ps(v.v, one));
+			_mm256_storeu_si256((__m256i*)sx, _mm256_blendv_epi8(inv, x, m));
+			_mm256_storeu_si256((__m256i*)sy, _mm256_blendv_epi8(inv, y, m));
+		}
+	};
+};
+
+#define CPU_KERNELS_NS Avx2
+#include "cpu_kernels.inl"
+#undef CPU_KERNELS_NS
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
@@ -0,0 +1,65 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#include <cmath>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "cpu_kernels.hpp"
+
+// SSE4.1 variant of the kernels, 4 pixels per step. Only called if the CPU supports it (CpuKernels::Detect)
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC target("sse4.1")
+#elif defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse4.1"))), apply_to = function)
+#endif
+
+namespace CpuKernels
+{
+	namespace Sse4
+	{
+		struct VF { static const int N = 4; __m128 v; };
+		struct VM { __m128 v; };
+
+		inline VF Set1(float a) { return { _mm_set1_ps(a) }; }
+		inline VF Ramp(float a) { return { _mm_add_ps(_mm_set1_ps(a), _mm_setr_ps(0, 1, 2, 3)) }; }
+		inline VF operator+(VF a, VF b) { return { _mm_add_ps(a.v, b.v) }; }
+		inline VF operator-(VF a, VF b) { return { _mm_sub_ps(a.v, b.v) }; }
+		inline VF operator*(VF a, VF b) { return { _mm_mul_ps(a.v, b.v) }; }
+		inline VF operator/(VF a, VF b) { return { _mm_div_ps(a.v, b.v) }; }
+		inline VF Sqrt(VF a) { return { _mm_sqrt_ps(a.v) }; }
+		inline VF Abs(VF a) { return { _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v) }; }
+		inline VF Min(VF a, VF b) { return { _mm_min_ps(a.v, b.v) }; }
+		inline VF Max(VF a, VF b) { return { _mm_max_ps(a.v, b.v) }; }
+		inline VM operator<(VF a, VF b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+		inline VM operator>(VF a, VF b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+		inline VM operator<=(VF a, VF b) { return { _mm_cmple_ps(a.v, b.v) }; }
+		inline VM operator>=(VF a, VF b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+		inline VM operator&(VM a, VM b) { return { _mm_and_ps(a.v, b.v) }; }
+		inline VF Select(VM m, VF a, VF b) { return { _mm_blendv_ps(b.v, a.v, m.v) }; }
+
+		inline void StoreFixed(VF u, VF v, VM valid, int32_t* sx, int32_t* sy)
+		{
+			__m128 one = _mm_set1_ps((float)(1 << FixBits));
+			__m128i inv = _mm_set1_epi32(Invalid);
+			__m128i m = _mm_castps_si128(valid.v);
+			__m128i x = _mm_cvtps_epi32(_mm_mul_ps(u.v, one));
+			__m128i y = _mm_cvtps_epi32(_mm_mul_ps(v.v, one));
+			_mm_storeu_si128((__m128i*)sx, _mm_blendv_epi8(inv, x, m));
+			_mm_storeu_si128((__m128i*)sy, _mm_blendv_epi8(inv, y, m));
+		}
+	};
+};
+
+#define CPU_KERNELS_NS Sse4
+#include "cpu_kernels.inl"
+#undef CPU_KERNELS_NS
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
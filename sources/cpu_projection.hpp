@@ -0,0 +1,238 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <vector>
+
+#include "util.hpp"
+#include "camera.hpp"
+#include "geometry.hpp"
+
+// Inverse of the GL projection: maps an output pixel to the texture coordinate the mesh in Geometry shows there.
+// Uses the same camera (Camera::CalcView, glm::perspective) and the same sphere/plane as Geometry::GeneratePoints
+class CpuProjection
+{
+public:
+	VrImageGeometryMapping::Type type = VrImageGeometryMapping::Type::Equirectangular;
+	int outWidth = 0, outHeight = 0;
+
+	glm::vec3 origin;
+	glm::vec3 dir0, dirX, dirY; // Ray for pixel (0,0) and step per pixel in x and y, not normalized
+
+	float rfx = util::pi, rfy = util::pi / 2;
+	float planeAspectRatio = 1;
+	cv::Rect2f fisheyeEllipseRect;
+
+	void Set(Camera& cam, Geometry& geom, int width, int height) { Set(cam, cam.cps, geom, width, height); }
+
+	// Projection for camera parameters p, which need not be the current state of cam
+	void Set(Camera& cam, Csp p, Geometry& geom, int width, int height)
+	{
+		type = geom.geomMappingType;
+		outWidth = width;
+		outHeight = height;
+		rfx = geom.FovRadX() / 2;
+		rfy = geom.FovRadY() / 2;
+		planeAspectRatio = geom.planeAspectRatio;
+		fisheyeEllipseRect = geom.fisheyeEllipseRect;
+
+		glm::mat3 invView = glm::mat3(glm::inverse(cam.CalcView(p, origin)));
+
+		float tanY = tanf(glm::radians(p.Fov()) / 2);
+		float tanX = tanY * width / (float)height;
+
+		// Pixel centers, row 0 at top of image (same as GlRenderTarget::renderImg after flip)
+		dir0 = invView * glm::vec3((1.0f / width - 1) * tanX, (1 - 1.0f / height) * tanY, -1);
+		dirX = invView * glm::vec3(2 * tanX / width, 0, 0);
+		dirY = invView * glm::vec3(0, -2 * tanY / height, 0);
+	}
+
+	glm::vec3 Ray(float x, float y) { return dir0 + x * dirX + y * dirY; }
+
+	// Point on the geometry hit by ray d from origin. Returns false if the ray misses it
+	bool Intersect(glm::vec3 d, glm::vec3& p)
+	{
+		const glm::vec3& o = origin;
+		if (type == VrImageGeometryMapping::Type::Flat)
+		{
+			if (d.z <= 0) return false;
+			float t = (1 - o.z) / d.z;
+			if (t <= 0) return false;
+			p = o + t * d;
+			return true;
+		}
+
+		// Unit sphere, camera is inside so use the far root
+		float a = glm::dot(d, d);
+		float b = glm::dot(o, d);
+		float c = glm::dot(o, o) - 1;
+		float disc = b * b - a * c;
+		if (disc < 0) return false;
+		float t = (-b + sqrtf(disc)) / a;
+		if (t <= 0) return false;
+		p = o + t * d;
+		return true;
+	}
+
+	// Texture coordinate (0..1) for point p on the geometry. Returns false if outside the part covered by the mesh
+	bool PointToTex(glm::vec3 p, glm::vec2& tex)
+	{
+		if (type == VrImageGeometryMapping::Type::Flat)
+		{
+			float tx = (planeAspectRatio - p.x) / (2 * planeAspectRatio);
+			float ty = (1 - p.y) / 2;
+			tex = glm::vec2(tx, ty);
+			return tx >= 0 && tx <= 1 && ty >= 0 && ty <= 1;
+		}
+
+		float ry = asinf(glm::clamp(-p.y, -1.0f, 1.0f));
+		float rx = atan2f(-p.x, p.z);
+		if (fabsf(rx) > rfx || fabsf(ry) > rfy)
+			return false;
+
+		float tx = (rx / rfx + 1) / 2;
+		float ty = (ry / rfy + 1) / 2;
+
+		if (type == VrImageGeometryMapping::Type::Fisheye)
+		{
+			// Same orthographic model as Geometry::GenerateSpherePoints
+			float pxy = sqrtf(p.x * p.x + p.y * p.y);
+			float a = atan2f(pxy, p.z);
+			float r = sinf(a);
+			float sc = r > 1e-6f ? 2 * a / (util::pi * r) : 2 / util::pi;
+			tx = (-p.x * sc + 1) / 2;
+			ty = (-p.y * sc + 1) / 2;
+			tx = fisheyeEllipseRect.x + tx * fisheyeEllipseRect.width;
+			ty = fisheyeEllipseRect.y + ty * fisheyeEllipseRect.height;
+		}
+
+		tex = glm::vec2(tx, ty);
+		return true;
+	}
+
+	bool Map(float x, float y, glm::vec2& tex)
+	{
+		glm::vec3 p;
+		return Intersect(Ray(x, y), p) && PointToTex(p, tex);
+	}
+
+	// Whether point p is in front of the camera and inside the image
+	bool Sees(glm::vec3 p)
+	{
+		glm::vec3 c = glm::inverse(glm::mat3(dirX, dirY, dir0)) * (p - origin);
+		if (c.z <= 0)
+			return false;
+		float x = c.x / c.z, y = c.y / c.z;
+		return x >= -0.5f && x <= outWidth - 0.5f && y >= -0.5f && y <= outHeight - 0.5f;
+	}
+
+	// Pixel rects of a texture of size tex that the view samples, with a margin for bilinear taps and the distance
+	// between sampled points. Two rects when the region wraps around at +-180 deg, none if the view misses the image
+	std::vector<cv::Rect> VisibleRegion(cv::Size tex, bool wrapX)
+	{
+		const int nx = 48, ny = 27;
+		std::vector<glm::vec2> pts((nx + 1) * (ny + 1));
+		std::vector<char> hit(pts.size());
+		for (int j = 0; j <= ny; j++)
+			for (int i = 0; i <= nx; i++)
+				hit[j * (nx + 1) + i] = Map(i * (outWidth - 1) / (float)nx, j * (outHeight - 1) / (float)ny, pts[j * (nx + 1) + i]);
+
+		// Points between neighbouring samples are at most a step away
+		float stepX = 0, stepY = 0, minY = 1, maxY = 0, minX = 1, maxX = 0;
+		bool any = false;
+		for (int j = 0; j <= ny; j++)
+			for (int i = 0; i <= nx; i++)
+			{
+				int k = j * (nx + 1) + i;
+				if (!hit[k])
+					continue;
+				any = true;
+				minX = std::min(minX, pts[k].x); maxX = std::max(maxX, pts[k].x);
+				minY = std::min(minY, pts[k].y); maxY = std::max(maxY, pts[k].y);
+				for (int n : { k + 1, k + nx + 1 })
+				{
+					if ((n == k + 1 && i == nx) || n >= (int)pts.size() || !hit[n])
+						continue;
+					float dx = fabsf(pts[n].x - pts[k].x);
+					if (wrapX)
+						dx = std::min(dx, 1 - dx);
+					stepX = std::max(stepX, dx);
+					stepY = std::max(stepY, fabsf(pts[n].y - pts[k].y));
+				}
+			}
+
+		std::vector<cv::Rect> rects;
+		if (!any)
+			return rects;
+
+		// Plus 1% for camera moves between upload and draw
+		float mx = stepX + 0.01f + 2.0f / tex.width, my = stepY + 0.01f + 2.0f / tex.height;
+		minY -= my; maxY += my;
+		bool fullWidth = false;
+		if (type == VrImageGeometryMapping::Type::Equirectangular && rfy >= util::pi / 2 - 1e-4f)
+		{
+			// Around a pole every longitude is sampled
+			if (Sees(glm::vec3(0, 1, 0))) { minY = 0; fullWidth = true; }
+			if (Sees(glm::vec3(0, -1, 0))) { maxY = 1; fullWidth = true; }
+		}
+		int y0 = std::max(0, (int)floorf(minY * tex.height));
+		int y1 = std::min(tex.height, (int)ceilf(maxY * tex.height));
+		if (y1 <= y0)
+			return rects;
+
+		if (!wrapX || fullWidth)
+		{
+			int x0 = fullWidth ? 0 : std::max(0, (int)floorf((minX - mx) * tex.width));
+			int x1 = fullWidth ? tex.width : std::min(tex.width, (int)ceilf((maxX + mx) * tex.width));
+			if (x1 > x0)
+				rects.push_back(cv::Rect(x0, y0, x1 - x0, y1 - y0));
+			return rects;
+		}
+
+		// Mark columns near a sample, the region is everything but the longest unmarked circular run
+		const int bins = 256;
+		std::vector<char> used(bins);
+		int reach = (int)ceilf(mx * bins);
+		for (size_t k = 0; k < pts.size(); k++)
+		{
+			if (!hit[k])
+				continue;
+			int b = (int)(pts[k].x * bins);
+			for (int d = -reach; d <= reach; d++)
+				used[((b + d) % bins + bins) % bins] = 1;
+		}
+
+		int gapStart = 0, gapLen = 0;
+		for (int b = 0; b < bins; b++)
+		{
+			int len = 0;
+			while (len < bins && !used[(b + len) % bins])
+				len++;
+			if (len > gapLen) { gapLen = len; gapStart = b; }
+		}
+
+		int b0 = (gapStart + gapLen) % bins; // Region runs from the end of the gap around to its start
+		int b1 = gapStart;
+		int x0 = b0 * tex.width / bins, x1 = b1 * tex.width / bins;
+		if (gapLen == 0)
+			rects.push_back(cv::Rect(0, y0, tex.width, y1 - y0));
+		else if (x0 < x1)
+			rects.push_back(cv::Rect(x0, y0, x1 - x0, y1 - y0));
+		else
+		{
+			if (x1 > 0) rects.push_back(cv::Rect(0, y0, x1, y1 - y0));
+			if (x0 < tex.width) rects.push_back(cv::Rect(x0, y0, tex.width - x0, y1 - y0));
+		}
+		return rects;
+	}
+
+	// True if texture coordinates wrap around horizontally, as with GL_REPEAT on a full 360 deg image
+	static bool WrapsX(Geometry& geom) { return geom.geomMappingType == VrImageGeometryMapping::Type::Equirectangular && geom.FovX >= 360; }
+};
@@ -0,0 +1,318 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include "util_cv.hpp"
+
+#include "camera.hpp"
+#include "videoframe.hpp"
+#include "config.hpp"
+#include "geometry.hpp"
+#include "cpu_projection.hpp"
+#include "remapcache.hpp"
+#include "cpu_kernels.hpp"
+#include "threadpool.hpp"
+
+// Renders the same image as GlRenderTarget (RGB8 or I420) without any GL context, either with the projection kernels
+// (source coordinates computed per pixel) or by remapping the source image with cached tables
+class CpuRenderTarget
+{
+public:
+	int renderWidth = 1280;
+	int renderHeight = 720;
+	PixelFormat outFormat = PixelFormat::BGR;
+	cv::Mat renderImg; // BGR, or I420 packed as FrameView::FromI420
+	cv::Mat remapImg; // BGR result of the remap path before conversion to I420
+	Config::Rgb backColor;
+	CpuProjection proj;
+	RemapCache cache;
+
+	cv::Mat mapX, mapY; // Source pixel coordinates, float
+	cv::Mat map1, map2; // Same in fixed point, CV_16SC2 + CV_16UC1 as produced by cv::convertMaps
+	cv::Mat shift1, shift2; // Cached table shifted to current yaw
+	cv::Size srcSize;
+	cv::Mat srcBgr; // YUV frame converted for the remap path
+
+	bool useRemap = false;
+	CpuKernels::Isa isa = CpuKernels::Isa::Scalar;
+
+	// Output is rendered in tiles, small enough that a tile and the source pixels it reads stay in cache
+	static const int TileWidth = 64;
+	static const int TileHeight = 64;
+	WorkStealingPool pool{ 1 };
+
+	void Init(Config& c, int width, int height, PixelFormat format = PixelFormat::BGR)
+	{
+		outFormat = format;
+		std::string kernel = c.GetString("CpuKernel", "auto");
+		useRemap = kernel == "remap";
+		isa = CpuKernels::Parse(kernel);
+		if (!useRemap)
+			pool.Start(c.GetInt("RenderThreads", 0));
+		std::cout << "Cpu renderer: " << (useRemap ? "remap" : CpuKernels::Name(isa));
+		if (!useRemap)
+			std::cout << ", " << pool.NumThreads() << " threads";
+		std::cout << std::endl;
+
+		cache.Init(c);
+		SetSize(width, height);
+	}
+
+	void SetSize(int width, int height)
+	{
+		renderWidth = width;
+		renderHeight = height;
+		cache.Clear();
+	}
+
+	void BuildMaps(Camera& cam, Csp cps, Geometry& geom)
+	{
+		proj.Set(cam, cps, geom, renderWidth, renderHeight);
+
+		ucv::Ensure(mapX, renderHeight, renderWidth, CV_32FC1);
+		ucv::Ensure(mapY, renderHeight, renderWidth, CV_32FC1);
+
+		const float outside = -10000; // Saturates in fixed point, still outside image -> background
+		float sw = (float)srcSize.width;
+		float sh = (float)srcSize.height;
+		for (int y = 0; y < renderHeight; y++)
+		{
+			float* mx = mapX.ptr<float>(y);
+			float* my = mapY.ptr<float>(y);
+			for (int x = 0; x < renderWidth; x++)
+			{
+				glm::vec2 tex;
+				if (proj.Map((float)x, (float)y, tex))
+				{
+					// Texel centers are at (i+0.5)/size, like GL
+					mx[x] = tex.x * sw - 0.5f;
+					my[x] = tex.y * sh - 0.5f;
+				}
+				else
+					mx[x] = my[x] = outside;
+			}
+		}
+
+		cv::convertMaps(mapX, mapY, map1, map2, CV_16SC2);
+	}
+
+	CpuKernels::Params KernelParams(Camera& cam, Geometry& geom)
+	{
+		proj.Set(cam, geom, renderWidth, renderHeight);
+
+		CpuKernels::Params p;
+		for (int i = 0; i < 3; i++)
+		{
+			p.origin[i] = proj.origin[i];
+			p.dir0[i] = proj.dir0[i];
+			p.dirX[i] = proj.dirX[i];
+			p.dirY[i] = proj.dirY[i];
+		}
+		p.rfx = proj.rfx;
+		p.rfy = proj.rfy;
+		p.planeAspectRatio = proj.planeAspectRatio;
+		p.fisheyeX = proj.fisheyeEllipseRect.x;
+		p.fisheyeY = proj.fisheyeEllipseRect.y;
+		p.fisheyeW = proj.fisheyeEllipseRect.width;
+		p.fisheyeH = proj.fisheyeEllipseRect.height;
+		p.srcWidth = (float)srcSize.width;
+		p.srcHeight = (float)srcSize.height;
+		return p;
+	}
+
+	FrameView Output() { return outFormat == PixelFormat::I420 ? FrameView::FromI420(renderImg) : FrameView::FromBgr(renderImg); }
+
+	void EnsureOutput()
+	{
+		if (outFormat == PixelFormat::I420)
+			ucv::Ensure(renderImg, renderHeight * 3 / 2, renderWidth, CV_8UC1);
+		else
+			ucv::Ensure(renderImg, renderHeight, renderWidth, CV_8UC3);
+	}
+
+	static CpuKernels::Image KernelImage(cv::Mat& m)
+	{
+		CpuKernels::Image im;
+		im.data = m.data;
+		im.step = m.step[0];
+		im.width = m.cols;
+		im.height = m.rows;
+		return im;
+	}
+
+	void DrawDirect(FrameView subFrame, Camera& cam, Geometry& geom)
+	{
+		srcSize = subFrame.Size();
+		EnsureOutput();
+
+		CpuKernels::Params p = KernelParams(cam, geom);
+		bool yuv = subFrame.Format == PixelFormat::I420;
+		CpuKernels::Image src;
+		CpuKernels::Planes planes;
+		if (yuv)
+		{
+			planes.y = KernelImage(subFrame.y);
+			planes.u = KernelImage(subFrame.u);
+			planes.v = KernelImage(subFrame.v);
+		}
+		else
+			src = KernelImage(subFrame.bgr);
+		bool i420 = outFormat == PixelFormat::I420;
+		FrameView out = Output();
+		CpuKernels::Image dst;
+		CpuKernels::Planes dstPlanes;
+		if (i420)
+		{
+			dstPlanes.y = KernelImage(out.y);
+			dstPlanes.u = KernelImage(out.u);
+			dstPlanes.v = KernelImage(out.v);
+		}
+		else
+			dst = KernelImage(renderImg);
+		CpuKernels::Background bg;
+		bg.b = (uint8_t)(backColor.b * 255);
+		bg.g = (uint8_t)(backColor.g * 255);
+		bg.r = (uint8_t)(backColor.r * 255);
+
+		bool wrapX = CpuProjection::WrapsX(geom);
+		auto type = geom.geomMappingType;
+
+		int tilesX = (renderWidth + TileWidth - 1) / TileWidth;
+		int tilesY = (renderHeight + TileHeight - 1) / TileHeight;
+		pool.Run(tilesX * tilesY, [&](int i)
+		{
+			int x0 = (i % tilesX) * TileWidth;
+			int y0 = (i / tilesX) * TileHeight;
+			int x1 = std::min(x0 + TileWidth, renderWidth);
+			int y1 = std::min(y0 + TileHeight, renderHeight);
+			if (i420)
+			{
+				if (yuv)
+					CpuKernels::Render(isa, type, p, planes, wrapX, dstPlanes, x0, y0, x1, y1, bg);
+				else
+					CpuKernels::Render(isa, type, p, src, wrapX, dstPlanes, x0, y0, x1, y1, bg);
+			}
+			else if (yuv)
+				CpuKernels::Render(isa, type, p, planes, wrapX, dst, x0, y0, x1, y1, bg);
+			else
+				CpuKernels::Render(isa, type, p, src, wrapX, dst, x0, y0, x1, y1, bg);
+		});
+	}
+
+	void Draw(FrameView view, Camera& cam, Geometry& geom)
+	{
+		if (!useRemap)
+		{
+			DrawDirect(view, cam, geom);
+			return;
+		}
+
+		cv::Mat subFrame = view.bgr;
+		if (view.Format != PixelFormat::BGR)
+		{
+			view.ToBgr(srcBgr);
+			subFrame = srcBgr;
+		}
+
+		if (subFrame.size() != srcSize)
+		{
+			srcSize = subFrame.size();
+			cache.Clear();
+		}
+
+		bool wrapX = CpuProjection::WrapsX(geom);
+		cv::Mat* m1 = &map1;
+		cv::Mat* m2 = &map2;
+
+		if (!cache.Enabled())
+			BuildMaps(cam, cam.cps, geom);
+		else
+		{
+			// For a full 360 equirectangular image a yaw change is just a horizontal shift of the source coordinates
+			bool yawShift = wrapX;
+			RemapCache::Entry* e = cache.Find(cam.cps, yawShift);
+			if (e == nullptr)
+			{
+				Csp q = cache.Quantize(cam.cps, yawShift);
+				BuildMaps(cam, q, geom);
+				e = cache.Add(q, yawShift, map1, map2);
+			}
+
+			if (e != nullptr)
+			{
+				m1 = &e->map1;
+				m2 = &e->map2;
+				float dYaw = cam.cps.Yaw() - e->cps.Yaw();
+				if (yawShift && dYaw != 0)
+				{
+					int shift32 = (int)roundf(dYaw / geom.FovX * srcSize.width * cv::INTER_TAB_SIZE);
+					RemapCache::ShiftX(*m1, *m2, shift1, shift2, shift32, srcSize.width);
+					m1 = &shift1;
+					m2 = &shift2;
+				}
+			}
+		}
+
+		cv::Scalar bc(backColor.b * 255, backColor.g * 255, backColor.r * 255);
+		int border = wrapX ? cv::BORDER_WRAP : cv::BORDER_CONSTANT;
+		if (outFormat == PixelFormat::I420)
+		{
+			cv::remap(subFrame, remapImg, *m1, *m2, cv::INTER_LINEAR, border, bc);
+			cv::cvtColor(remapImg, renderImg, cv::COLOR_BGR2YUV_I420);
+		}
+		else
+			cv::remap(subFrame, renderImg, *m1, *m2, cv::INTER_LINEAR, border, bc);
+	}
+
+	// Renders a synthetic 8K equirectangular source at the configured output size with 1..N threads, sweeping
+	// the camera over the poles so tiles have uneven cost, and prints time per frame and speedup
+	static void Benchmark(Config& c, int frames = 60)
+	{
+		cv::Mat src(3840, 7680, CV_8UC3);
+		cv::randu(src, cv::Scalar::all(0), cv::Scalar::all(255));
+
+		Geometry geom;
+		geom.Set(VrImageGeometryMapping::Type::Equirectangular, 360, 180);
+		Camera cam;
+
+		int maxThreads = (int)std::thread::hardware_concurrency();
+		std::vector<int> counts;
+		for (int n = 1; n < maxThreads; n *= 2)
+			counts.push_back(n);
+		counts.push_back(std::max(maxThreads, 1));
+
+		CpuRenderTarget rt;
+		rt.isa = CpuKernels::Parse(c.GetString("CpuKernel", "auto"));
+		rt.SetSize(c.getWidth(), c.getHeight());
+		std::cout << "Render benchmark: " << src.cols << "x" << src.rows << " -> " << rt.renderWidth << "x" << rt.renderHeight
+			<< ", " << CpuKernels::Name(rt.isa) << ", " << frames << " frames" << std::endl;
+
+		double ms1 = 0;
+		for (int n : counts)
+		{
+			rt.pool.Start(n);
+			rt.pool.steals = 0;
+			rt.DrawDirect(FrameView::FromBgr(src), cam, geom); // Warm up
+
+			auto t0 = std::chrono::steady_clock::now();
+			for (int f = 0; f < frames; f++)
+			{
+				float a = f / (float)frames;
+				cam.cps = Csp(360 * a - 180, 80 * sinf(2 * util::pi * a), c.GetFloat("Fov", 65), c.GetFloat("BackOff", 50));
+				rt.DrawDirect(FrameView::FromBgr(src), cam, geom);
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count() / frames;
+			if (n == 1)
+				ms1 = ms;
+
+			std::cout << n << " threads: " << 0.01f * (int)(ms * 100) << " ms/frame, " << 0.1f * (int)(10000 / ms) << " fps, speedup "
+				<< 0.01f * (int)(ms1 / ms * 100) << ", " << rt.pool.steals << " steals" << std::endl;
+		}
+	}
+};
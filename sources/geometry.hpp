@@ -7,6 +7,7 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <glm/glm.hpp>
 #include "vrimageformat.hpp"
 
@@ -18,8 +19,6 @@ public:
 		float x=0, y=0, z=0, u=0, v=0;
 		xyzyv() {}
 		xyzyv(float px, float py, float pz, float tu, float tv) { x = px; y = py; z = pz; u = tu; v = tv; }
-
-		float UvDist2(glm::vec2 uv) { return (u - uv.x) * (u - uv.x) + (v - uv.y) * (v - uv.y); }
 	};
 
 	VrImageGeometryMapping::Type geomMappingType = VrImageGeometryMapping::Type::Equirectangular;
@@ -34,11 +33,24 @@ public:
 	float FovRadY() { return util::rad(FovY); }
 
 	std::vector<xyzyv> pts;
-	std::vector<xyzyv> verticesVec;
 
-	int numRects;
+	// The mesh is drawn in patches of PatchCells x PatchCells grid cells, each with indices for every level of
+	// detail. Only patches in the view frustum are drawn, all at the coarsest level that looks the same
+	static const int PatchCells = 16;
+	static const int NumLods = 4; // Quads of 1, 2, 4 or 8 grid cells
+	struct Patch
+	{
+		glm::vec3 center;
+		float radius = 0;
+		int first[NumLods], count[NumLods]; // Into the element buffer
+	};
+	std::vector<Patch> patches;
+	int numRects = 0;
+	int drawnRects = 0; // Last GlDraw
+
+	bool analytic = false; // No mesh, shaders project per fragment from a full screen triangle, see Shader::Init
 	bool voAllocated = false;
-	unsigned int VBO=0, VAO=0;
+	unsigned int VBO=0, VAO=0, EBO=0;
 
 	void DeleteVo()
 	{
@@ -47,6 +59,7 @@ public:
 			voAllocated = false;
 			glDeleteVertexArrays(1, &VAO);
 			glDeleteBuffers(1, &VBO);
+			glDeleteBuffers(1, &EBO);
 		}
 	}
 
@@ -56,6 +69,7 @@ public:
 		voAllocated = true;
 		glGenVertexArrays(1, &VAO);
 		glGenBuffers(1, &VBO);
+		glGenBuffers(1, &EBO);
 	}
 
 
@@ -167,75 +181,90 @@ public:
 			GenerateSpherePoints();
 	}
 
-	glm::vec3 Tex2Dir(float u, float v)
+	// Indices grouped by level, then patch, so neighbouring visible patches can be drawn as one range
+	void GenerateIndices(std::vector<unsigned int>& indices)
 	{
-		auto N = pts.size();
-		glm::vec2 uv(u, v);
-		int ib = 0;
-		float db = 0;
-		for (int i=0; i<N; i++)
+		numRects = (Nx - 1) * (Ny - 1);
+		patches.clear();
+		for (int py = 0; py < Ny - 1; py += PatchCells)
+			for (int px = 0; px < Nx - 1; px += PatchCells)
+			{
+				int x1 = std::min(px + PatchCells, Nx - 1), y1 = std::min(py + PatchCells, Ny - 1);
+				glm::vec3 lo(1e9f), hi(-1e9f);
+				for (int y = py; y <= y1; y++)
+					for (int x = px; x <= x1; x++)
+					{
+						auto& q = pts[y * Nx + x];
+						lo = glm::min(lo, glm::vec3(q.x, q.y, q.z));
+						hi = glm::max(hi, glm::vec3(q.x, q.y, q.z));
+					}
+				Patch p;
+				p.center = (lo + hi) / 2.0f;
+				p.radius = glm::length(hi - lo) / 2;
+				patches.push_back(p);
+			}
+
+		indices.clear();
+		int patchesX = (Nx - 1 + PatchCells - 1) / PatchCells;
+		for (int lod = 0; lod < NumLods; lod++)
 		{
-			float d = pts[i].UvDist2(uv);
-			if (i == 0 || d < db)
+			int step = 1 << lod;
+			for (size_t i = 0; i < patches.size(); i++)
 			{
-				ib = i;
-				db = d;
+				int px = (int)(i % patchesX) * PatchCells, py = (int)(i / patchesX) * PatchCells;
+				int x1 = std::min(px + PatchCells, Nx - 1), y1 = std::min(py + PatchCells, Ny - 1);
+				patches[i].first[lod] = (int)indices.size();
+				for (int y = py; y < y1; y += step)
+					for (int x = px; x < x1; x += step)
+					{
+						int xb = std::min(x + step, x1), yb = std::min(y + step, y1);
+						unsigned int a = y * Nx + x, b = y * Nx + xb, c = yb * Nx + xb, d = yb * Nx + x;
+						for (unsigned int v : { a, b, c, c, d, a })
+							indices.push_back(v);
+					}
+				patches[i].count[lod] = (int)indices.size() - patches[i].first[lod];
 			}
 		}
-
-		float el = ib - 1 < 0 ? 9 : pts[ib - 1].UvDist2(uv);
-		float er = ib + 1 >= N ? 9 : pts[ib + 1].UvDist2(uv);
-		float eu = ib - Nx < 0 ? 9 : pts[ib - Nx].UvDist2(uv);
-		float ed = ib + Nx >= N ? 9 : pts[ib + Nx].UvDist2(uv);
-		int ix = el < er ? -1 : 1;
-		int iy = eu < ed ? -Nx : Nx;
-		auto& p = pts[ib];
-		auto& px = pts[ib + ix];
-		auto& py = pts[ib + iy];
-		float rx = (u - p.u) / (px.u - p.u);
-		float ry = (v - p.v) / (py.v - p.v);
-		float x = (1 - rx) * p.x + rx * px.x;
-		float y = (1 - ry) * p.y + ry * py.y;
-		float z = 1 - (x * x + y * y);
-		z = z > 0 ? sqrt(z) : 0;
-
-		return glm::vec3(x, y, z);
 	}
 
-	void GenerateVerts()
+	// Coarsest level where the flat quads stay within half a pixel of the sphere. A chord over angle a sags about a*a/8,
+	// and towards the poles texture coordinates bend more over a quad, so the error grows by 1 / cos(latitude)
+	int Lod(float fov, int height, float cosLat = 1)
 	{
-		GeneratePoints();
-
-		numRects = (Nx - 1) * (Ny - 1);
-		verticesVec.clear();
-		verticesVec.reserve(numRects * 6);
-
-		int vi = 0;
-		for (int y = 0; y < Ny - 1; y++)
-			for (int x = 0; x < Nx - 1; x++)
-			{
-				verticesVec.push_back(pts[y * Nx + x]);
-				verticesVec.push_back(pts[y * Nx + x + 1]);
-				verticesVec.push_back(pts[(y + 1) * Nx + x + 1]);
-
-				verticesVec.push_back(pts[(y + 1) * Nx + x + 1]);
-				verticesVec.push_back(pts[(y + 1) * Nx + x]);
-				verticesVec.push_back(pts[y * Nx + x]);
-			}
+		if (geomMappingType == VrImageGeometryMapping::Type::Flat)
+			return 0;
+		float pxPerRad = height / 2 / tanf(util::rad(fov) / 2);
+		float cell = std::max(FovRadX() / (Nx - 1), FovRadY() / (Ny - 1));
+		int lod = 0;
+		while (lod + 1 < NumLods)
+		{
+			float a = cell * (1 << (lod + 1));
+			if (a * a / 8 * pxPerRad > 0.5f * cosLat)
+				break;
+			lod++;
+		}
+		return lod;
 	}
 
 	void GlGenerate()
 	{
-		GenerateVerts();
+		if (analytic)
+		{
+			AllocVo(); // Core profile needs a bound VAO even with no attributes
+			return;
+		}
 
-		float* vertices = (float*)verticesVec.data();
-		int sizeof_vertices = numRects * 6 * 5 * sizeof(float);
+		GeneratePoints();
+		std::vector<unsigned int> indices;
+		GenerateIndices(indices);
 
 		AllocVo();
 		glBindVertexArray(VAO);
 
 		glBindBuffer(GL_ARRAY_BUFFER, VBO);
-		glBufferData(GL_ARRAY_BUFFER, sizeof_vertices, vertices, GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, pts.size() * sizeof(xyzyv), pts.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
 
 		// position attribute
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
@@ -245,10 +274,64 @@ public:
 		glEnableVertexAttribArray(1);
 	}
 
-	void GlDraw()
+	// Draws the patches a camera with this view matrix, vertical fov and output size sees
+	void GlDraw(const glm::mat4& view, float fov, int width, int height)
 	{
 		glBindVertexArray(VAO);
-		glDrawArrays(GL_TRIANGLES, 0, 2 * 3 * numRects);
+		if (analytic)
+		{
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			return;
+		}
+
+		// Side planes of the frustum in view space, normals pointing out
+		float tanY = tanf(util::rad(fov) / 2);
+		float tanX = tanY * width / height;
+		const glm::vec3 planes[4] = {
+			glm::normalize(glm::vec3(1, 0, tanX)), glm::normalize(glm::vec3(-1, 0, tanX)),
+			glm::normalize(glm::vec3(0, 1, tanY)), glm::normalize(glm::vec3(0, -1, tanY)) };
+		const float zNear = 0.1f;
+
+		visiblePatches.clear();
+		float maxY = 0;
+		for (auto& p : patches)
+		{
+			glm::vec3 c = glm::vec3(view * glm::vec4(p.center, 1));
+			bool visible = c.z - p.radius < -zNear;
+			for (int i = 0; visible && i < 4; i++)
+				visible = glm::dot(c, planes[i]) <= p.radius;
+			if (!visible)
+				continue;
+			visiblePatches.push_back(&p);
+			maxY = std::max(maxY, fabsf(p.center.y) + p.radius);
+		}
+
+		int lod = Lod(fov, height, sqrtf(std::max(0.0f, 1 - maxY * maxY)));
+		drawCounts.clear();
+		drawOffsets.clear();
+		drawnRects = 0;
+		for (Patch* pp : visiblePatches)
+		{
+			Patch& p = *pp;
+			if (p.count[lod] == 0)
+				continue;
+
+			drawnRects += p.count[lod] / 6;
+			const char* offset = (const char*)(p.first[lod] * sizeof(unsigned int));
+			if (!drawOffsets.empty() && (const char*)drawOffsets.back() + drawCounts.back() * sizeof(unsigned int) == offset)
+				drawCounts.back() += p.count[lod];
+			else
+			{
+				drawCounts.push_back(p.count[lod]);
+				drawOffsets.push_back(offset);
+			}
+		}
+		glMultiDrawElements(GL_TRIANGLES, drawCounts.data(), GL_UNSIGNED_INT, drawOffsets.data(), (GLsizei)drawCounts.size());
 	}
+
+private:
+	std::vector<Patch*> visiblePatches;
+	std::vector<GLsizei> drawCounts;
+	std::vector<const void*> drawOffsets;
 };
 
@@ -9,15 +9,89 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#include <iostream>
+#include <cstdlib>
+
+#if defined(UNVR_WITH_EGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 class GlBase
 {
 protected:
-	void GlInit()
+	// GLFW 3.3 has no platform without a window system, this fails without an X or Wayland display
+	bool GlInit(bool visible = true, int contextApi = GLFW_NATIVE_CONTEXT_API)
 	{
-		glfwInit();
+		if (!glfwInit())
+			return false;
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, contextApi);
+		return true;
+	}
+
+	static bool GlHasDisplay()
+	{
+#if defined(_WIN32)
+		return true;
+#else
+		auto set = [](const char* name) { const char* v = std::getenv(name); return v != nullptr && *v != 0; };
+		return set("DISPLAY") || set("WAYLAND_DISPLAY");
+#endif
+	}
+
+	void* eglDisplay = nullptr;
+	void* eglContext = nullptr;
+
+	// Surfaceless EGL context (Mesa, incl. llvmpipe), needs no window system at all. Makes it current and loads GL
+	bool GlInitEgl()
+	{
+#if defined(UNVR_WITH_EGL)
+		auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		EGLDisplay display = getPlatformDisplay != nullptr ?
+			getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr) : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		EGLint major, minor;
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+		{
+			std::cout << "Failed to initialize EGL" << std::endl;
+			return false;
+		}
+		eglBindAPI(EGL_OPENGL_API);
+
+		const EGLint contextAttribs[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 3,
+			EGL_CONTEXT_MINOR_VERSION, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE };
+		EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttribs);
+		if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+		{
+			std::cout << "Failed to create EGL context" << std::endl;
+			eglTerminate(display);
+			return false;
+		}
+		eglDisplay = display;
+		eglContext = context;
+		return gladLoadGLLoader((GLADloadproc)eglGetProcAddress) != 0;
+#else
+		std::cout << "GlContext = egl needs a build with UNVR_WITH_EGL" << std::endl;
+		return false;
+#endif
+	}
+
+	void GlTerminateEgl()
+	{
+#if defined(UNVR_WITH_EGL)
+		if (eglDisplay == nullptr)
+			return;
+		eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(eglDisplay, eglContext);
+		eglTerminate(eglDisplay);
+		eglDisplay = eglContext = nullptr;
+#endif
 	}
 
 	unsigned int glGenTexture()
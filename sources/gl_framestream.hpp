@@ -0,0 +1,302 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <iostream>
+
+#include <opencv2/opencv.hpp>
+
+#include "videoframe.hpp"
+#include "shader.hpp"
+
+// Uploads decoded frames to the source textures. Texture storage is allocated once per video, and with GL 4.4 every
+// VideoFrame decodes straight into its own persistently mapped pixel unpack buffer, so an upload is a copy on the GPU
+// with no allocation and no synchronous driver copy. The buffer must not be decoded into again before Wait returns.
+// Without GL 4.4, or for frames outside the buffers, glTexSubImage3D reads from the frame's own memory.
+// Each texture is an array with one layer per tile. A frame larger than GL_MAX_TEXTURE_SIZE is split into a grid of
+// tiles, each stored with a one texel border copied from its neighbours so linear filtering is seamless. The shaders
+// pick the tile per sample, see SetUniforms. Frames that fit are a single tile with no border, as a plain texture
+class GlFrameStream
+{
+public:
+	unsigned int textures[3] = { 0, 0, 0 }; // BGR frame, or Y, U and V planes. U and V stay bound to units 1 and 2
+	bool persistent = false;
+	long long pixelsUploaded = 0, pixelsOffered = 0; // Luma pixels, for how much partial uploads save
+	int maxTextureSize = 0; // Largest tile, 0 or above GL_MAX_TEXTURE_SIZE is GL_MAX_TEXTURE_SIZE. Set before Init
+	int tilesX = 1, tilesY = 1;
+
+	// Allocates textures of width x height, and returns one frame sized Mat per buffer over mapped memory for
+	// VideoInput::SetFrameBuffers, none if GL 4.4 is missing
+	std::vector<cv::Mat> Init(PixelFormat pixelFormat, int width, int height, cv::Size frameSize, int numBuffers)
+	{
+		format = pixelFormat;
+		Allocate(width, height);
+
+		std::vector<cv::Mat> mats;
+		persistent = GLAD_GL_VERSION_4_4 && numBuffers > 0;
+		if (!persistent)
+			return mats;
+
+		int type = format == PixelFormat::I420 ? CV_8UC1 : CV_8UC3;
+		int rows = format == PixelFormat::I420 ? frameSize.height * 3 / 2 : frameSize.height;
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		buffers.resize(numBuffers);
+		for (auto& b : buffers)
+		{
+			b.size = (size_t)rows * frameSize.width * (type == CV_8UC3 ? 3 : 1);
+			glGenBuffers(1, &b.pbo);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b.pbo);
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, b.size, NULL, flags);
+			b.mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, b.size, flags);
+			if (b.mapped != nullptr)
+				mats.push_back(cv::Mat(rows, frameSize.width, type, b.mapped));
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return mats;
+	}
+
+	// The tile grid for the sampling shader s. Set again whenever a frame of another size reallocates the textures
+	void SetUniforms(Shader& s)
+	{
+		shader = &s;
+		ApplyUniforms();
+	}
+
+	void Upload(FrameView view)
+	{
+		cv::Size size = view.Base().size();
+		Upload(view, { cv::Rect(0, 0, size.width, size.height) });
+	}
+
+	// Uploads only the given rects of view, the rest of the textures keeps whatever it had
+	void Upload(FrameView view, const std::vector<cv::Rect>& rects)
+	{
+		cv::Size size = view.Base().size();
+		if (size.width != texWidth || size.height != texHeight)
+		{
+			Allocate(size.width, size.height);
+			if (shader != nullptr)
+				ApplyUniforms();
+		}
+
+		int n = view.Format == PixelFormat::I420 ? 3 : 1;
+		cv::Mat planes[3] = { view.Base(), view.u, view.v };
+
+		Buffer* b = Find(planes[0].data);
+		if (b != nullptr)
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b->pbo);
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		pixelsOffered += size.area();
+		for (cv::Rect r : rects)
+		{
+			if (n == 3)
+			{
+				// Even, so chroma rects line up
+				int x1 = std::min(size.width, (r.x + r.width + 1) & ~1), y1 = std::min(size.height, (r.y + r.height + 1) & ~1);
+				r.x &= ~1; r.y &= ~1;
+				r.width = x1 - r.x; r.height = y1 - r.y;
+			}
+			pixelsUploaded += r.area();
+
+			for (int i = 0; i < n; i++)
+				UploadTiles(i, planes[i], i == 0 ? r : cv::Rect(r.x / 2, r.y / 2, r.width / 2, r.height / 2), b);
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textures[0]);
+
+		if (b != nullptr)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			if (b->fence != 0)
+				glDeleteSync(b->fence);
+			b->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+	}
+
+	// Replaces the source with img until the next upload, for the tracker's debug image. Only for a BGR source that
+	// is a single tile of img's size
+	void UploadDebug(const cv::Mat& img)
+	{
+		if (format != PixelFormat::BGR || tilesX * tilesY != 1 || img.cols != texWidth || img.rows != texHeight || img.type() != CV_8UC3)
+			return;
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textures[0]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, (int)(img.step / img.elemSize()));
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, img.cols, img.rows, 1, GL_BGR, GL_UNSIGNED_BYTE, img.data);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
+
+	// Waits until the GPU is done reading frame's buffer, so the decoder can fill it again
+	void Wait(VideoFrame* frame)
+	{
+		Buffer* b = Find(frame->Frame.data);
+		if (b == nullptr || b->fence == 0)
+			return;
+
+		while (glClientWaitSync(b->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(b->fence);
+		b->fence = 0;
+	}
+
+	// Only once nothing decodes into the buffers any more
+	void Delete()
+	{
+		for (auto& b : buffers)
+		{
+			if (b.fence != 0)
+				glDeleteSync(b.fence);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b.pbo);
+			if (b.mapped != nullptr)
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &b.pbo);
+		}
+		buffers.clear();
+		DeleteTextures();
+	}
+
+private:
+	struct Buffer
+	{
+		unsigned int pbo = 0;
+		uint8_t* mapped = nullptr;
+		size_t size = 0;
+		GLsync fence = 0;
+	};
+
+	std::vector<Buffer> buffers;
+	PixelFormat format = PixelFormat::BGR;
+	Shader* shader = nullptr; // Samples the textures, see SetUniforms
+	int texWidth = 0, texHeight = 0;
+	int tileWidth = 0, tileHeight = 0; // Luma texels per tile, excluding the border
+	int borderX = 0, borderY = 0;
+
+	void ApplyUniforms()
+	{
+		shader->use();
+		shader->setVec2("sourceTexels", (float)texWidth, (float)texHeight);
+		shader->setVec2("tileTexels", (float)tileWidth, (float)tileHeight);
+		shader->setVec2("tileBorder", (float)borderX, (float)borderY);
+		shader->setIVec2("tiles", tilesX, tilesY);
+	}
+
+	// The buffer p points into, if any. A frame the decoder had to reallocate is no longer in its buffer
+	Buffer* Find(const uint8_t* p)
+	{
+		for (auto& b : buffers)
+			if (b.mapped != nullptr && p >= b.mapped && p < b.mapped + b.size)
+				return &b;
+		return nullptr;
+	}
+
+	void DeleteTextures()
+	{
+		for (auto& t : textures)
+		{
+			if (t != 0)
+				glDeleteTextures(1, &t);
+			t = 0;
+		}
+		texWidth = texHeight = 0;
+	}
+
+	// Copies rect r of plane m to every tile whose texels, border included, overlap it. Texels past the edges of the
+	// frame wrap around, as GL_REPEAT on a single tile
+	void UploadTiles(int plane, cv::Mat m, cv::Rect r, Buffer* b)
+	{
+		int s = plane == 0 ? 1 : 2;
+		int tw = tileWidth / s, th = tileHeight / s;
+		cv::Rect frame(-borderX, -borderY, m.cols + 2 * borderX, m.rows + 2 * borderY);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textures[plane]);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, (int)(m.step / m.elemSize()));
+		for (int ty = 0; ty < tilesY; ty++)
+			for (int tx = 0; tx < tilesX; tx++)
+			{
+				cv::Rect tile(tx * tw - borderX, ty * th - borderY, tw + 2 * borderX, th + 2 * borderY);
+				for (int wy = -1; wy <= 1; wy++)
+					for (int wx = -1; wx <= 1; wx++)
+					{
+						cv::Point shift(wx * m.cols, wy * m.rows);
+						cv::Rect t = tile & frame & cv::Rect(r.tl() + shift, r.size());
+						if (t.empty())
+							continue;
+						cv::Mat sub = m(cv::Rect(t.tl() - shift, t.size()));
+						const void* src = b != nullptr ? (const void*)(sub.data - b->mapped) : (const void*)sub.data;
+						glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, t.x - tile.x, t.y - tile.y, ty * tilesX + tx, t.width, t.height, 1,
+							format == PixelFormat::I420 ? GL_RED : GL_BGR, GL_UNSIGNED_BYTE, src);
+					}
+			}
+	}
+
+	// Splits size into tiles of at most maxSize texels, border included. Even, so chroma tiles are exactly half
+	static void Split(int size, int maxSize, int& tiles, int& tileSize, int& border)
+	{
+		tiles = 1;
+		tileSize = size;
+		border = 0;
+		if (size <= maxSize)
+			return;
+
+		border = 1;
+		int usable = (maxSize - 2 * border) & ~1;
+		tiles = (size + usable - 1) / usable;
+		tileSize = ((size + tiles - 1) / tiles + 1) & ~1;
+	}
+
+	// Immutable storage with GL 4.2, otherwise specified once with glTexImage3D
+	void Allocate(int width, int height)
+	{
+		DeleteTextures();
+		texWidth = width;
+		texHeight = height;
+
+		// A smaller maxTextureSize splits frames that would fit, so the tiled path can be tried on any video. Tiles are
+		// made larger again rather than run out of array layers
+		GLint glMax = 0, maxLayers = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &glMax);
+		glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+		int maxSize = maxTextureSize > 0 ? std::min(std::max(maxTextureSize, 64), (int)glMax) : glMax;
+		while (true)
+		{
+			Split(width, maxSize, tilesX, tileWidth, borderX);
+			Split(height, maxSize, tilesY, tileHeight, borderY);
+			if (tilesX * tilesY <= maxLayers || maxSize >= glMax)
+				break;
+			maxSize = std::min(2 * maxSize, (int)glMax);
+		}
+
+		int n = format == PixelFormat::I420 ? 3 : 1;
+		for (int i = 0; i < n; i++)
+		{
+			int w = (i == 0 ? tileWidth : tileWidth / 2) + 2 * borderX;
+			int h = (i == 0 ? tileHeight : tileHeight / 2) + 2 * borderY;
+			GLenum internalFormat = n == 1 ? GL_RGB8 : GL_R8;
+
+			// A single tile wraps around by itself, tiles have the wrapped texels in their borders
+			glActiveTexture(GL_TEXTURE0 + i);
+			glGenTextures(1, &textures[i]);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, textures[i]);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, tilesX == 1 ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, tilesY == 1 ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			if (GLAD_GL_VERSION_4_2)
+				glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, internalFormat, w, h, tilesX * tilesY);
+			else
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internalFormat, w, h, tilesX * tilesY, 0, n == 1 ? GL_BGR : GL_RED, GL_UNSIGNED_BYTE, NULL);
+		}
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textures[0]);
+	}
+};
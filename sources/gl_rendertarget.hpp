@@ -18,29 +18,90 @@
 #include "util_cv.hpp"
 
 #include "camera.hpp"
-#include "shader.hpp"
+#include "gl_shaders.hpp"
 #include "geometry.hpp"
+#include "videoframe.hpp"
+#include "cpu_projection.hpp"
 
 
+// BT.601 limited range RGB -> I420, as cv::COLOR_BGR2YUV_I420. Each fragment of a width x height*3/2 R8 target is one
+// byte of the packed I420 frame (Y plane, then U, then V), read back as is. The image is already drawn top row first
+static const char* i420PackVertexCode = R"QQ(
+#version 330 core
+void main()
+{
+	vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(p * 2.0 - 1.0, 0, 1);
+}
+)QQ";
+
+static const char* i420PackFragmentCode = R"QQ(
+#version 330 core
+layout(location = 0) out float value;
+uniform sampler2D image;
+uniform int width;
+uniform int height;
+
+vec3 Rgb(int x, int y) { return texelFetch(image, ivec2(x, y), 0).rgb; }
+
+void main()
+{
+	int i = int(gl_FragCoord.y) * width + int(gl_FragCoord.x);
+	int ySize = width * height;
+	int cw = width / 2;
+	int cSize = cw * (height / 2);
+	if (i < ySize)
+	{
+		value = dot(Rgb(i % width, i / width), vec3(0.257, 0.504, 0.098)) + 0.0627;
+		return;
+	}
+
+	int j = i - ySize;
+	bool isV = j >= cSize;
+	if (isV)
+		j -= cSize;
+	int x = 2 * (j % cw), y = 2 * (j / cw);
+	vec3 c = 0.25 * (Rgb(x, y) + Rgb(x + 1, y) + Rgb(x, y + 1) + Rgb(x + 1, y + 1));
+	value = (isV ? dot(c, vec3(0.439, -0.368, -0.071)) : dot(c, vec3(-0.148, -0.291, 0.439))) + 0.502;
+}
+)QQ";
+
 class GlRenderTarget
 {
 public:
-	enum class Type { RGB8, Uv16 };
+	enum class Type { RGB8, Uv16, I420 }; // I420: drawn as RGB8, then packed to I420 on the GPU
 	Type type;
 	int renderWidth = 1280;
 	int renderHeight = 720;
-	cv::Mat dumpbuf;
 	cv::Mat renderImg;
 	Shader* shader;
+	GlCameraBuffer camera;
 	unsigned int framebuffer;
+	unsigned int colorTexture = 0;
 	Config::Rgb backColor;
 
-	void Init(Shader& s, Type rendertype, int width, int height)
+	Shader packShader;
+	unsigned int packFramebuffer = 0, packTexture = 0, emptyVao = 0;
+
+	// Readback ring: each Draw reads into the next pixel buffer and fences it, the oldest is copied to renderImg once
+	// more than latency frames are in flight. latency 0 reads back synchronously
+	struct Readback
+	{
+		unsigned int pbo = 0;
+		GLsync fence = 0;
+	};
+	std::vector<Readback> ring;
+	int latency = 0;
+	int ringHead = 0; // Next buffer to read into
+	int inFlight = 0;
+
+	void Init(Shader& s, Type rendertype, int width, int height, int readbackLatency = 0)
 	{
 		shader = &s;
 		type = rendertype;
 		renderWidth = width;
 		renderHeight = height;
+		latency = std::max(0, readbackLatency);
 
 		glGenFramebuffers(1, &framebuffer);
 		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
@@ -49,7 +110,8 @@ public:
 		unsigned int textureColorbuffer;
 		glGenTextures(1, &textureColorbuffer);
 		glBindTexture(GL_TEXTURE_2D, textureColorbuffer);
-		if (type == Type::RGB8)
+		colorTexture = textureColorbuffer;
+		if (type == Type::RGB8 || type == Type::I420)
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, renderWidth, renderHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
 		if (type == Type::Uv16)
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RG, renderWidth, renderHeight, 0, GL_RG, GL_UNSIGNED_SHORT, NULL);
@@ -76,21 +138,204 @@ public:
 
 		// bind to framebuffer and draw scene as we normally would to color texture 
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		if (type == Type::I420)
+			InitPack();
+		InitRing();
+	}
+
+	int ReadRows() { return type == Type::I420 ? renderHeight * 3 / 2 : renderHeight; }
+
+	void EnsureRenderImg()
+	{
+		if (type == Type::RGB8)
+			ucv::Ensure(renderImg, renderHeight, renderWidth, CV_8UC3);
+		if (type == Type::Uv16)
+			ucv::Ensure(renderImg, renderHeight, renderWidth, CV_16UC2);
+		if (type == Type::I420)
+			ucv::Ensure(renderImg, renderHeight * 3 / 2, renderWidth, CV_8UC1);
+	}
+
+	void InitRing()
+	{
+		EnsureRenderImg();
+		ring.resize(latency == 0 ? 0 : latency + 1);
+		for (auto& rb : ring)
+		{
+			glGenBuffers(1, &rb.pbo);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+			glBufferData(GL_PIXEL_PACK_BUFFER, renderImg.total() * renderImg.elemSize(), NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		ringHead = inFlight = 0;
+	}
+
+	// Reads the bound framebuffer into dst, a pixel buffer offset when one is bound to GL_PIXEL_PACK_BUFFER
+	void ReadPixels(void* dst)
+	{
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		if (type == Type::RGB8)
+			glReadPixels(0, 0, renderWidth, renderHeight, GL_BGR, GL_UNSIGNED_BYTE, dst);
+		if (type == Type::Uv16)
+			glReadPixels(0, 0, renderWidth, renderHeight, GL_RG, GL_UNSIGNED_SHORT, dst);
+		if (type == Type::I420)
+			glReadPixels(0, 0, renderWidth, renderHeight * 3 / 2, GL_RED, GL_UNSIGNED_BYTE, dst);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	}
+
+	// Waits for the oldest frame in flight and copies it to renderImg. False if none. A buffer that fails to map is
+	// dropped and the next one taken, so no fence is left in flight behind it
+	bool Flush()
+	{
+		while (inFlight > 0)
+		{
+			int n = (int)ring.size();
+			Readback& rb = ring[(ringHead - inFlight + n) % n];
+			while (glClientWaitSync(rb.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+				;
+			glDeleteSync(rb.fence);
+			rb.fence = 0;
+			inFlight--;
+
+			EnsureRenderImg(); // May have been handed to the encoder
+			size_t size = renderImg.total() * renderImg.elemSize();
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+			void* p = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+			if (p != nullptr)
+			{
+				memcpy(renderImg.data, p, size);
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			if (p != nullptr)
+				return true;
+			std::cout << "Readback: mapping the pixel buffer failed (GL error " << glGetError() << "), frame dropped" << std::endl;
+		}
+		return false;
+	}
+
+	// Drops the frames in flight without reading them, for when what has been drawn should not reach the output
+	void Discard()
+	{
+		for (auto& rb : ring)
+		{
+			if (rb.fence != 0)
+			{
+				while (glClientWaitSync(rb.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+					;
+				glDeleteSync(rb.fence);
+				rb.fence = 0;
+			}
+		}
+		ringHead = inFlight = 0;
+	}
+
+	void InitPack()
+	{
+		packShader.Init(i420PackVertexCode, i420PackFragmentCode);
+		packShader.use();
+		packShader.setInt("image", 0);
+		packShader.setInt("width", renderWidth);
+		packShader.setInt("height", renderHeight);
+		glGenVertexArrays(1, &emptyVao); // Core profile needs a bound VAO even with no attributes
+
+		glGenFramebuffers(1, &packFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, packFramebuffer);
+		glGenTextures(1, &packTexture);
+		glBindTexture(GL_TEXTURE_2D, packTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, renderWidth, renderHeight * 3 / 2, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, packTexture, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			std::cout << "ERROR::FRAMEBUFFER:: I420 framebuffer is not complete!" << std::endl;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
 
+	// Converts the RGB color attachment into packFramebuffer, leaves it bound for reading
+	void Pack()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, packFramebuffer);
+		glViewport(0, 0, renderWidth, renderHeight * 3 / 2);
+		glDisable(GL_DEPTH_TEST);
+
+		packShader.use();
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, colorTexture);
+		glBindVertexArray(emptyVao);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glBindVertexArray(0);
+
+		glEnable(GL_DEPTH_TEST);
+	}
+
+	// Camera block for a width x height viewport, for the mesh or the analytic projection as geom is set up
+	static void SetCamera(GlCameraBuffer& buffer, Camera& cam, Geometry& geom, int width, int height, bool flipY)
+	{
+		GlCameraBlock b;
+		if (!geom.analytic)
+		{
+			b.projection = glm::perspective(glm::radians(cam.fov()), (width / (float)height), 0.1f, 100.0f);
+			if (flipY)
+				b.projection = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, 1.0f)) * b.projection;
+			b.view = cam.CalcView();
+			buffer.Set(b);
+			return;
+		}
+
+		CpuProjection p;
+		p.Set(cam, geom, width, height);
+		// Image pixel (x, y) is at window position (x + 0.5, y + 0.5) flipped, else at (x + 0.5, height - 0.5 - y)
+		glm::vec3 c = p.dir0 - 0.5f * p.dirX + (flipY ? -0.5f : height - 0.5f) * p.dirY;
+		b.rayMatrix = glm::mat4(glm::mat3(p.dirX, flipY ? p.dirY : -p.dirY, c));
+		b.origin = glm::vec4(p.origin, 1);
+		b.halfFov = glm::vec4(p.rfx, p.rfy, p.planeAspectRatio, 0);
+		cv::Rect2f r = p.fisheyeEllipseRect;
+		b.fisheyeRect = glm::vec4(r.x, r.y, r.width, r.height);
+		buffer.Set(b);
+	}
+
+	// Where Present puts the image in a width x height window, scaled to fit and centered. Top left origin
+	cv::Rect ScreenRect(int width, int height)
+	{
+		float scale = std::min(width / (float)renderWidth, height / (float)renderHeight);
+		int w = (int)(renderWidth * scale + 0.5f), h = (int)(renderHeight * scale + 0.5f);
+		return cv::Rect((width - w) / 2, (height - h) / 2, w, h);
+	}
+
+	// Scales the last drawn image into the default framebuffer, with backColor around it
+	void Present(int width, int height)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, width, height);
+		glClearColor(backColor.r, backColor.g, backColor.b, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		// The image is drawn top row first, the window has its bottom row first
+		cv::Rect r = ScreenRect(width, height);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		glBlitFramebuffer(0, 0, renderWidth, renderHeight, r.x, height - r.y, r.x + r.width, height - r.y - r.height,
+			GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	FrameView Output() { return type == Type::I420 ? FrameView::FromI420(renderImg) : FrameView::FromBgr(renderImg); }
+
 	void SetSize(int width, int height)
 	{
 		renderWidth = width;
 		renderHeight = height;
 	}
 
-	void Draw(int texture1, Camera& cam, Geometry& geom)
+	// True when renderImg holds a new frame, which with latency > 0 is the one drawn latency calls ago
+	bool Draw(int texture1, Camera& cam, Geometry& geom)
 	{
 		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 		shader->use();
 		glViewport(0, 0, renderWidth, renderHeight);
 
-		if (type == Type::RGB8)
+		if (type == Type::RGB8 || type == Type::I420)
 			glClearColor(backColor.r, backColor.g, backColor.b, 1.0f);
 		if (type == Type::Uv16)
 			glClearColor(0, 0, 0, 1);
@@ -98,43 +343,34 @@ public:
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, texture1);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture1);
 
-		glm::mat4 projection = glm::perspective(glm::radians(cam.fov()), (renderWidth / (float)renderHeight), 0.1f, 100.0f);
-		shader->setMat4("projection", projection);
-		glm::mat4 view = cam.CalcView();
-		shader->setMat4("view", view);
-		geom.GlDraw();
-
-		//std::fstream dumpbuf_fd("c:/git/LearnOpenGL-master/fbodump.rgb", std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
-		//dumpbuf_fd.write((char*)dumpbuf, scrWidth * scrHeight * 3);
-		{
-			int size = renderWidth * renderHeight * 3;
-			if (type == Type::Uv16)
-				size = renderWidth * renderHeight * 4;
+		// Flipped vertically, so framebuffer row 0 (first row read back) is the top of the image
+		SetCamera(camera, cam, geom, renderWidth, renderHeight, true);
+		geom.GlDraw(cam.CalcView(), cam.fov(), renderWidth, renderHeight);
 
-			glReadBuffer(GL_COLOR_ATTACHMENT0);
-			if (type == Type::RGB8)
-			{
-				ucv::Ensure(dumpbuf, renderHeight, renderWidth, CV_8UC3);
+		if (type == Type::I420)
+			Pack();
 
-				glReadPixels(0, 0, renderWidth, renderHeight, GL_BGR, GL_UNSIGNED_BYTE, dumpbuf.data);
-				cv::flip(dumpbuf, renderImg, 0);
-			}
-			if (type == Type::Uv16)
-			{
-				ucv::Ensure(renderImg, renderHeight, renderWidth, CV_16UC2);
-				ucv::Ensure(dumpbuf, renderHeight, renderWidth, CV_32SC1); // Flip doesn't like CV_16UC2, so pretend to be CV_32SC1 instead
-				cv::Mat renderImgx(renderHeight, renderWidth, CV_32SC1, (void*)renderImg.data);
+		EnsureRenderImg();
+		bool ready = true;
+		if (ring.empty())
+			ReadPixels(renderImg.data);
+		else
+		{
+			Readback& rb = ring[ringHead];
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+			ReadPixels(0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			rb.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			ringHead = (ringHead + 1) % (int)ring.size();
+			inFlight++;
 
-				glReadPixels(0, 0, renderWidth, renderHeight, GL_RG, GL_UNSIGNED_SHORT, dumpbuf.data);
-				cv::flip(dumpbuf, renderImgx, 0);
-				assert(renderImg.data == renderImgx.data);
-			}
+			ready = inFlight > latency && Flush();
 		}
 
-		// ----------------
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return ready;
 	}
 };
 
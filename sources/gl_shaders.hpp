@@ -0,0 +1,85 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <glad/glad.h>
+
+#include <map>
+
+#include <glm/glm.hpp>
+
+#include "shader.hpp"
+#include "geometry.hpp"
+
+// Per frame camera data, shared by all programs as the uniform block Camera. Laid out as std140
+struct GlCameraBlock
+{
+	glm::mat4 view = glm::mat4(1.0f);
+	glm::mat4 projection = glm::mat4(1.0f);
+	glm::mat4 rayMatrix = glm::mat4(1.0f); // mat3 from window position (x, y, 1) to view ray, columns padded to vec4
+	glm::vec4 origin = glm::vec4(0.0f);
+	glm::vec4 halfFov = glm::vec4(0.0f); // z is planeAspectRatio
+	glm::vec4 fisheyeRect = glm::vec4(0.0f);
+};
+
+// Uniform buffer with one GlCameraBlock. Each viewport has its own, so setting one doesn't wait for draws using another
+class GlCameraBuffer
+{
+public:
+	unsigned int ubo = 0;
+
+	// Uploads block and binds it for the following draws
+	void Set(const GlCameraBlock& block)
+	{
+		if (ubo == 0)
+		{
+			glGenBuffers(1, &ubo);
+			glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+			glBufferData(GL_UNIFORM_BUFFER, sizeof(GlCameraBlock), NULL, GL_DYNAMIC_DRAW);
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(GlCameraBlock), &block);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, Shader::CameraBinding, ubo);
+	}
+
+	void Delete()
+	{
+		if (ubo != 0)
+			glDeleteBuffers(1, &ubo);
+		ubo = 0;
+	}
+};
+
+// Source drawing programs by variant, compiled (or loaded from Shader::binaryCacheFolder) on first use
+class GlShaders
+{
+public:
+	Shader& Get(bool toImg, bool yuv, Geometry& geom)
+	{
+		// The mesh projects in the vertex shader, so its programs are the same for every mapping
+		auto mapping = geom.analytic ? geom.geomMappingType : VrImageGeometryMapping::Type::Unknown;
+		int key = (int)toImg | (int)yuv << 1 | (int)geom.analytic << 2 | (int)mapping << 3;
+		auto it = programs.find(key);
+		if (it != programs.end())
+			return it->second;
+
+		Shader& s = programs[key];
+		s.Init(toImg, yuv, geom.analytic, mapping);
+		return s;
+	}
+
+	void Delete()
+	{
+		for (auto& p : programs)
+			p.second.Delete();
+		programs.clear();
+	}
+
+private:
+	std::map<int, Shader> programs;
+};
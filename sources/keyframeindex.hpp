@@ -0,0 +1,93 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include <cstdint>
+
+// Keyframes of a video, with their timestamp and byte position, sorted by frame number. Scanning a long video for them
+// reads the whole file, so the result is kept next to it as <video>.unvr.keyframes
+class KeyframeIndex
+{
+public:
+	struct Keyframe
+	{
+		int frame;
+		int64_t pts; // In the video stream's time base
+		int64_t pos; // Byte position of the packet, -1 if unknown
+	};
+	std::vector<Keyframe> keyframes;
+
+	static std::string SidecarPath(const std::string& video) { return video + ".unvr.keyframes"; }
+
+	void Add(int frame, int64_t pts, int64_t pos)
+	{
+		keyframes.push_back({ frame, pts, pos });
+	}
+
+	// Packets come in decode order, which isn't always frame order
+	void Sort()
+	{
+		std::sort(keyframes.begin(), keyframes.end(), [](const Keyframe& a, const Keyframe& b) { return a.frame < b.frame; });
+	}
+
+	// Last keyframe at or before frame, nullptr if there is none
+	const Keyframe* Before(int frame) const
+	{
+		auto it = std::upper_bound(keyframes.begin(), keyframes.end(), frame, [](int f, const Keyframe& k) { return f < k.frame; });
+		return it == keyframes.begin() ? nullptr : &*(it - 1);
+	}
+
+	// Most frames a seek has to decode forward from a keyframe
+	int LongestGop(int frameCount) const
+	{
+		int longest = 0;
+		for (size_t i = 0; i < keyframes.size(); i++)
+			longest = std::max(longest, (i + 1 < keyframes.size() ? keyframes[i + 1].frame : frameCount) - keyframes[i].frame);
+		return longest;
+	}
+
+	// False if there is no sidecar or the video has changed since it was written
+	bool Load(const std::string& video)
+	{
+		std::ifstream f(SidecarPath(video));
+		std::string header, stamp;
+		if (!std::getline(f, header) || header != "unvr keyframes 1" || !std::getline(f, stamp) || stamp != Stamp(video))
+			return false;
+		keyframes.clear();
+		Keyframe k;
+		while (f >> k.frame >> k.pts >> k.pos)
+			keyframes.push_back(k);
+		return !keyframes.empty();
+	}
+
+	bool Save(const std::string& video)
+	{
+		std::ofstream f(SidecarPath(video));
+		if (!f)
+			return false;
+		f << "unvr keyframes 1" << std::endl << Stamp(video) << std::endl;
+		for (auto& k : keyframes)
+			f << k.frame << " " << k.pts << " " << k.pos << "\n";
+		return f.good();
+	}
+
+private:
+	// Size and modification time of the video
+	static std::string Stamp(const std::string& video)
+	{
+		std::error_code ec;
+		std::ostringstream os;
+		os << std::filesystem::file_size(video, ec) << " " << std::filesystem::last_write_time(video, ec).time_since_epoch().count();
+		return os.str();
+	}
+};
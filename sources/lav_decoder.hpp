@@ -0,0 +1,318 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#if defined(UNVR_WITH_LIBAV)
+
+#include <string>
+#include <stdexcept>
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+}
+
+#include "videodecoder.hpp"
+#include "keyframeindex.hpp"
+
+// libavformat/libavcodec directly: decoder threads are configurable, frame numbers come from timestamps, seeks go to
+// the keyframe before and decode forward to the exact frame, and 8 bit YUV 4:2:0 is handed out without a copy. The
+// keyframes are indexed, so a seek never decodes more than one GOP
+class LavDecoder : public VideoDecoder
+{
+public:
+	int threads = 0; // 0 lets libavcodec decide
+	bool frameThreads = true, sliceThreads = true;
+	std::string keyframeIndex = "sidecar"; // sidecar, memory or off, see KeyframeIndex in config
+
+	~LavDecoder() { Close(); }
+
+	bool Open(const std::string& path, bool wantI420) override
+	{
+		if (avformat_open_input(&fmt, path.c_str(), nullptr, nullptr) < 0)
+			return false;
+		if (avformat_find_stream_info(fmt, nullptr) < 0)
+			return false;
+
+#if LIBAVFORMAT_VERSION_MAJOR < 59
+		AVCodec* codec = nullptr;
+#else
+		const AVCodec* codec = nullptr;
+#endif
+		streamIndex = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+		if (streamIndex < 0)
+			return false;
+		AVStream* st = fmt->streams[streamIndex];
+
+		ctx = avcodec_alloc_context3(codec);
+		avcodec_parameters_to_context(ctx, st->codecpar);
+		ctx->thread_count = threads;
+		ctx->thread_type = (frameThreads ? FF_THREAD_FRAME : 0) | (sliceThreads ? FF_THREAD_SLICE : 0);
+		if (avcodec_open2(ctx, codec, nullptr) < 0)
+			return false;
+
+		timeBase = av_q2d(st->time_base);
+		startPts = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+		AVRational rate = st->avg_frame_rate.num != 0 ? st->avg_frame_rate : st->r_frame_rate;
+		fps = av_q2d(rate);
+		width = ctx->width;
+		height = ctx->height;
+		if (st->nb_frames > 0)
+			frameCount = (int)st->nb_frames;
+		else if (st->duration != AV_NOPTS_VALUE)
+			frameCount = (int)(st->duration * timeBase * fps + 0.5);
+		else
+			frameCount = (int)(fmt->duration / (double)AV_TIME_BASE * fps + 0.5);
+
+		pkt = av_packet_alloc();
+		frame = av_frame_alloc();
+		StartIndex(path);
+
+		bool i420 = wantI420 && width % 2 == 0 && height % 2 == 0;
+		pixelFormat = i420 ? PixelFormat::I420 : PixelFormat::BGR;
+		zeroCopy = i420 && IsI420(ctx->pix_fmt, ctx->color_range);
+		if (wantI420)
+			std::cout << "Decoding to " << (i420 ? "I420" : "BGR") << (zeroCopy ? ", decoder planes used as is" : "") << std::endl;
+		std::cout << "libav " << codec->name << " decoder, " << (ctx->thread_count > 0 ? std::to_string(ctx->thread_count) : "auto") << " threads" << std::endl;
+		return true;
+	}
+
+	bool Grab() override
+	{
+		while (true)
+		{
+			int r = avcodec_receive_frame(ctx, frame);
+			if (r == 0)
+			{
+				int64_t pts = frame->best_effort_timestamp;
+				position = pts != AV_NOPTS_VALUE ? PtsToFrame(pts) : position + 1;
+				return true;
+			}
+			if (r == AVERROR_EOF)
+			{
+				position = frameCount;
+				return false;
+			}
+			if (r != AVERROR(EAGAIN))
+				throw std::runtime_error("libav: decoding failed");
+
+			if (av_read_frame(fmt, pkt) < 0)
+			{
+				avcodec_send_packet(ctx, nullptr); // End of file, drain the decoder
+				continue;
+			}
+			if (pkt->stream_index == streamIndex)
+				avcodec_send_packet(ctx, pkt);
+			av_packet_unref(pkt);
+		}
+	}
+
+	int Position() override { return position; }
+
+	void Retrieve(VideoFrame* vf) override
+	{
+		vf->Owner.reset();
+		vf->Format = pixelFormat;
+		int w = frame->width, h = frame->height;
+
+		if (pixelFormat == PixelFormat::I420 && IsI420(frame->format, frame->color_range))
+		{
+			FrameView planes;
+			planes.Format = PixelFormat::I420;
+			planes.y = cv::Mat(h, w, CV_8UC1, frame->data[0], frame->linesize[0]);
+			planes.u = cv::Mat(h / 2, w / 2, CV_8UC1, frame->data[1], frame->linesize[1]);
+			planes.v = cv::Mat(h / 2, w / 2, CV_8UC1, frame->data[2], frame->linesize[2]);
+
+			if (vf->BufferIndex < 0)
+			{
+				// A new reference to the same buffers, the decoder moves on to another frame
+				vf->Planes = planes;
+				vf->Owner = std::shared_ptr<void>(av_frame_clone(frame), [](void* p) { AVFrame* f = (AVFrame*)p; av_frame_free(&f); });
+				return;
+			}
+
+			// The frame has an upload buffer, copying into it is the upload
+			FrameView dst = FrameView::FromI420(vf->Frame);
+			planes.y.copyTo(dst.y);
+			planes.u.copyTo(dst.u);
+			planes.v.copyTo(dst.v);
+			return;
+		}
+
+		// Other formats (10 bit, 4:2:2, full range, ...) are converted
+		bool i420 = pixelFormat == PixelFormat::I420;
+		vf->Frame.create(i420 ? h * 3 / 2 : h, w, i420 ? CV_8UC1 : CV_8UC3);
+		// swscale takes the YUVJ formats as full range, plain YUV only when told so. The output is limited range
+		bool fullRange = frame->color_range == AVCOL_RANGE_JPEG;
+		if (fullRange != swsFullRange)
+		{
+			sws_freeContext(sws); // A new one goes by the format again
+			sws = nullptr;
+		}
+		SwsContext* last = sws;
+		sws = sws_getCachedContext(sws, w, h, (AVPixelFormat)frame->format, w, h, i420 ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_BGR24,
+			SWS_BILINEAR, nullptr, nullptr, nullptr);
+		if (sws == nullptr)
+			throw std::runtime_error("libav: unsupported pixel format");
+		if (fullRange && sws != last)
+		{
+			const int* coefs = sws_getCoefficients(SWS_CS_ITU601);
+			sws_setColorspaceDetails(sws, coefs, 1, coefs, 0, 0, 1 << 16, 1 << 16);
+		}
+		swsFullRange = fullRange;
+
+		uint8_t* dst[4] = { nullptr };
+		int dstStride[4] = { 0 };
+		if (i420)
+		{
+			FrameView d = FrameView::FromI420(vf->Frame);
+			dst[0] = d.y.data; dst[1] = d.u.data; dst[2] = d.v.data;
+			dstStride[0] = (int)d.y.step[0]; dstStride[1] = (int)d.u.step[0]; dstStride[2] = (int)d.v.step[0];
+		}
+		else
+		{
+			dst[0] = vf->Frame.data;
+			dstStride[0] = (int)vf->Frame.step[0];
+		}
+		sws_scale(sws, frame->data, frame->linesize, 0, h, dst, dstStride);
+	}
+
+	// Seeks to the keyframe at or before frame and decodes forward to it, so the result is exact whatever the GOP. A
+	// target later in the GOP being decoded is reached without seeking. Until the index is there the demuxer picks
+	// the keyframe
+	void Seek(int target) override
+	{
+		const KeyframeIndex::Keyframe* k = indexReady ? index.Before(target) : nullptr;
+		bool sameGop = k != nullptr && k->frame <= position && position <= target;
+		if (!sameGop)
+		{
+			bool ok = k != nullptr ? SeekKeyframe(*k) : av_seek_frame(fmt, streamIndex, FrameToPts(target), AVSEEK_FLAG_BACKWARD) >= 0;
+			if (!ok)
+				throw std::runtime_error("libav: seek failed");
+			avcodec_flush_buffers(ctx);
+			if (!Grab())
+				return;
+		}
+		while (position < target && Grab())
+			;
+	}
+
+	void Close() override
+	{
+		indexStop = true;
+		if (indexThread.joinable())
+			indexThread.join();
+		sws_freeContext(sws);
+		sws = nullptr;
+		swsFullRange = false;
+		av_frame_free(&frame);
+		av_packet_free(&pkt);
+		avcodec_free_context(&ctx);
+		avformat_close_input(&fmt);
+	}
+
+private:
+	AVFormatContext* fmt = nullptr;
+	AVCodecContext* ctx = nullptr;
+	AVPacket* pkt = nullptr;
+	AVFrame* frame = nullptr;
+	SwsContext* sws = nullptr;
+	bool swsFullRange = false; // sws is set up for a full range source
+	int streamIndex = -1;
+	double timeBase = 0;
+	int64_t startPts = 0;
+	int position = -1;
+
+	KeyframeIndex index; // Set once, by the time indexReady is
+	std::atomic<bool> indexReady{ false };
+	std::atomic<bool> indexStop{ false };
+	std::thread indexThread;
+
+	// Loads the sidecar, or scans the file on a thread of its own while decoding starts
+	void StartIndex(const std::string& path)
+	{
+		if (keyframeIndex == "off")
+			return;
+		if (keyframeIndex == "sidecar" && index.Load(path))
+		{
+			indexReady = true;
+			std::cout << "Keyframe index: " << index.keyframes.size() << " keyframes, longest GOP " << index.LongestGop(frameCount) << " frames" << std::endl;
+			return;
+		}
+		indexStop = false;
+		indexThread = std::thread([this, path] { ScanIndex(path); });
+	}
+
+	// Reads the video packets without decoding them and notes the keyframes
+	void ScanIndex(const std::string& path)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		AVFormatContext* scan = nullptr;
+		if (avformat_open_input(&scan, path.c_str(), nullptr, nullptr) < 0)
+			return;
+		if (avformat_find_stream_info(scan, nullptr) < 0 || streamIndex >= (int)scan->nb_streams)
+		{
+			avformat_close_input(&scan);
+			return;
+		}
+		for (int i = 0; i < (int)scan->nb_streams; i++)
+			if (i != streamIndex)
+				scan->streams[i]->discard = AVDISCARD_ALL;
+
+		KeyframeIndex found;
+		AVPacket* p = av_packet_alloc();
+		int r = 0;
+		while (!indexStop && (r = av_read_frame(scan, p)) >= 0)
+		{
+			int64_t ts = p->pts != AV_NOPTS_VALUE ? p->pts : p->dts;
+			if (p->stream_index == streamIndex && (p->flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE)
+				found.Add(PtsToFrame(ts), ts, p->pos);
+			av_packet_unref(p);
+		}
+		av_packet_free(&p);
+		avformat_close_input(&scan);
+		if (indexStop || found.keyframes.empty())
+			return;
+		// Seeks past where a read error cut the scan short would go wrong, so a partial index is neither used nor saved
+		if (r != AVERROR_EOF)
+		{
+			std::cout << "Keyframe index: reading the video failed after " << found.keyframes.size() << " keyframes, seeking without it" << std::endl;
+			return;
+		}
+
+		found.Sort();
+		index = std::move(found);
+		indexReady = true;
+		bool saved = keyframeIndex == "sidecar" && index.Save(path);
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		std::cout << "Keyframe index: " << index.keyframes.size() << " keyframes, longest GOP " << index.LongestGop(frameCount)
+			<< " frames, scanned in " << (int)(secs * 1000) << " ms" << (saved ? ", saved to " + KeyframeIndex::SidecarPath(path) : "") << std::endl;
+	}
+
+	// By timestamp, or by byte position for demuxers that can't seek by time
+	bool SeekKeyframe(const KeyframeIndex::Keyframe& k)
+	{
+		if (av_seek_frame(fmt, streamIndex, k.pts, AVSEEK_FLAG_BACKWARD) >= 0)
+			return true;
+		return k.pos >= 0 && av_seek_frame(fmt, streamIndex, k.pos, AVSEEK_FLAG_BYTE) >= 0;
+	}
+
+	// What the I420 consumers take as is: 8 bit 4:2:0, BT.601 limited range. YUVJ420P and full range frames are
+	// converted
+	static bool IsI420(int format, AVColorRange range) { return format == AV_PIX_FMT_YUV420P && range != AVCOL_RANGE_JPEG; }
+
+	int PtsToFrame(int64_t pts) { return (int)((pts - startPts) * timeBase * fps + 0.5); }
+	int64_t FrameToPts(int frameNo) { return startPts + (int64_t)(frameNo / (fps * timeBase) + 0.5); }
+};
+
+#endif
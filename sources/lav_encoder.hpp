@@ -0,0 +1,261 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#if defined(UNVR_WITH_LIBAV)
+
+#include <string>
+#include <iostream>
+#include <cstdint>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <libavutil/opt.h>
+}
+
+#include "videoencoder.hpp"
+
+// libavcodec/libavformat directly: the encoder, preset, CRF, threads and GOP come from config, I420 frames go in
+// without a color conversion, and the source audio packets are copied into the same file as the video is written
+class LavEncoder : public VideoEncoder
+{
+public:
+	~LavEncoder() { Close(); }
+
+	bool Open(Config& c, const std::string& path, double fps, cv::Size size, const std::string& audioSource) override
+	{
+		if (avformat_alloc_output_context2(&out, nullptr, nullptr, path.c_str()) < 0 || out == nullptr)
+			return false;
+
+		std::string name = c.GetString("OutEncoder", "libx264");
+		const AVCodec* codec = avcodec_find_encoder_by_name(name.c_str());
+		if (codec == nullptr)
+		{
+			std::cout << "OutEncoder " << name << " is not in this libavcodec" << std::endl;
+			return false;
+		}
+
+		video = avformat_new_stream(out, nullptr);
+		ctx = avcodec_alloc_context3(codec);
+		ctx->width = size.width;
+		ctx->height = size.height;
+		ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+		ctx->framerate = av_d2q(fps, 100000);
+		ctx->time_base = av_inv_q(ctx->framerate);
+		ctx->thread_count = c.GetInt("OutThreads", 0);
+		int gop = c.GetInt("OutGop", -1);
+		if (gop > 0)
+			ctx->gop_size = gop;
+		int bFrames = c.GetInt("OutBFrames", -1);
+		if (bFrames >= 0)
+			ctx->max_b_frames = bFrames;
+		if (out->oformat->flags & AVFMT_GLOBALHEADER)
+			ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+		// Encoders without these options leave them unused
+		AVDictionary* opts = nullptr;
+		std::string preset = c.GetString("OutPreset", "medium");
+		std::string crf = c.GetString("OutCrf", "20");
+		if (!preset.empty())
+			av_dict_set(&opts, "preset", preset.c_str(), 0);
+		if (!crf.empty())
+			av_dict_set(&opts, "crf", crf.c_str(), 0);
+		int r = avcodec_open2(ctx, codec, &opts);
+		av_dict_free(&opts);
+		if (r < 0)
+		{
+			std::cout << "Unable to open the " << name << " encoder" << std::endl;
+			return false;
+		}
+		avcodec_parameters_from_context(video->codecpar, ctx);
+		video->time_base = ctx->time_base;
+
+		if (!audioSource.empty())
+			OpenAudio(audioSource, c.timeStartSec, c.timeEndSec);
+
+		if (!(out->oformat->flags & AVFMT_NOFILE) && avio_open(&out->pb, path.c_str(), AVIO_FLAG_WRITE) < 0)
+			return false;
+		if (avformat_write_header(out, nullptr) < 0)
+			return false;
+
+		frame = av_frame_alloc();
+		frame->format = ctx->pix_fmt;
+		frame->width = ctx->width;
+		frame->height = ctx->height;
+		av_frame_get_buffer(frame, 0);
+		pkt = av_packet_alloc();
+		frameRate = fps;
+		frameNo = 0;
+		open = true;
+		std::cout << "libav " << name << " encoder" << (hasAudio ? ", copying source audio" : "") << std::endl;
+		return true;
+	}
+
+	bool IsOpen() override { return open; }
+
+	void Write(FrameView view) override
+	{
+		av_frame_make_writable(frame); // The encoder may still hold the last one
+		int w = frame->width, h = frame->height;
+		if (view.Format == PixelFormat::I420)
+		{
+			view.y.copyTo(cv::Mat(h, w, CV_8UC1, frame->data[0], frame->linesize[0]));
+			view.u.copyTo(cv::Mat(h / 2, w / 2, CV_8UC1, frame->data[1], frame->linesize[1]));
+			view.v.copyTo(cv::Mat(h / 2, w / 2, CV_8UC1, frame->data[2], frame->linesize[2]));
+		}
+		else
+		{
+			sws = sws_getCachedContext(sws, w, h, AV_PIX_FMT_BGR24, w, h, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+			const uint8_t* src[1] = { view.bgr.data };
+			int srcStride[1] = { (int)view.bgr.step[0] };
+			sws_scale(sws, src, srcStride, 0, h, frame->data, frame->linesize);
+		}
+		frame->pts = frameNo++;
+		Encode(frame);
+		if (hasAudio)
+			CopyAudio(frameNo / frameRate);
+	}
+
+	void Close() override
+	{
+		if (open)
+		{
+			Encode(nullptr);
+			if (hasAudio)
+				CopyAudio(frameNo / frameRate); // Audio ends with the video
+			av_write_trailer(out);
+			open = false;
+		}
+		if (out != nullptr && !(out->oformat->flags & AVFMT_NOFILE))
+			avio_closep(&out->pb);
+		avformat_free_context(out);
+		out = nullptr;
+		avformat_close_input(&in);
+		avcodec_free_context(&ctx);
+		av_frame_free(&frame);
+		av_packet_free(&pkt);
+		av_packet_free(&audioPkt);
+		sws_freeContext(sws);
+		sws = nullptr;
+		hasAudio = false;
+	}
+
+private:
+	AVFormatContext* out = nullptr;
+	AVCodecContext* ctx = nullptr;
+	AVStream* video = nullptr;
+	AVFrame* frame = nullptr;
+	AVPacket* pkt = nullptr;
+	SwsContext* sws = nullptr;
+	double frameRate = 0;
+	int64_t frameNo = 0;
+	bool open = false;
+
+	// Source audio, copied packet by packet between audioStart and audioEnd (input time base)
+	AVFormatContext* in = nullptr;
+	AVStream* audio = nullptr;
+	AVPacket* audioPkt = nullptr;
+	int audioIn = -1;
+	int64_t audioStart = 0, audioEnd = INT64_MAX;
+	bool audioPending = false; // audioPkt is read but later than the video so far
+	bool audioDone = false;
+
+	bool OpenAudio(const std::string& source, double startSec, double endSec)
+	{
+		if (avformat_open_input(&in, source.c_str(), nullptr, nullptr) < 0 || avformat_find_stream_info(in, nullptr) < 0)
+			return false;
+		audioIn = av_find_best_stream(in, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+		if (audioIn < 0)
+		{
+			std::cout << "Source has no audio to copy" << std::endl;
+			avformat_close_input(&in);
+			return false;
+		}
+
+		AVStream* ist = in->streams[audioIn];
+		audio = avformat_new_stream(out, nullptr);
+		avcodec_parameters_copy(audio->codecpar, ist->codecpar);
+		audio->codecpar->codec_tag = 0;
+		audio->time_base = ist->time_base;
+
+		int64_t first = ist->start_time != AV_NOPTS_VALUE ? ist->start_time : 0;
+		AVRational secs = av_make_q(1, AV_TIME_BASE);
+		audioStart = first + av_rescale_q((int64_t)(startSec * AV_TIME_BASE), secs, ist->time_base);
+		if (endSec < 999999)
+			audioEnd = first + av_rescale_q((int64_t)(endSec * AV_TIME_BASE), secs, ist->time_base);
+		if (startSec > 0)
+			av_seek_frame(in, audioIn, audioStart, AVSEEK_FLAG_BACKWARD);
+
+		audioPkt = av_packet_alloc();
+		audioPending = audioDone = false;
+		hasAudio = true;
+		return true;
+	}
+
+	void Encode(AVFrame* f)
+	{
+		avcodec_send_frame(ctx, f);
+		while (avcodec_receive_packet(ctx, pkt) == 0)
+		{
+			av_packet_rescale_ts(pkt, ctx->time_base, video->time_base);
+			pkt->stream_index = video->index;
+			av_interleaved_write_frame(out, pkt);
+		}
+	}
+
+	// Audio packets up to secs into the output, so the muxer gets them interleaved with the video
+	void CopyAudio(double secs)
+	{
+		AVStream* ist = in->streams[audioIn];
+		int64_t until = audioStart + (int64_t)(secs / av_q2d(ist->time_base));
+		while (!audioDone)
+		{
+			if (!audioPending)
+			{
+				if (av_read_frame(in, audioPkt) < 0)
+				{
+					audioDone = true;
+					return;
+				}
+				if (audioPkt->stream_index != audioIn || audioPkt->pts == AV_NOPTS_VALUE)
+				{
+					av_packet_unref(audioPkt);
+					continue;
+				}
+				audioPending = true;
+			}
+
+			if (audioPkt->pts >= audioEnd)
+			{
+				av_packet_unref(audioPkt);
+				audioPending = false;
+				audioDone = true;
+				return;
+			}
+			if (audioPkt->pts > until)
+				return;
+
+			audioPending = false;
+			if (audioPkt->pts < audioStart)
+			{
+				av_packet_unref(audioPkt);
+				continue;
+			}
+			audioPkt->pts -= audioStart;
+			if (audioPkt->dts != AV_NOPTS_VALUE)
+				audioPkt->dts -= audioStart;
+			av_packet_rescale_ts(audioPkt, ist->time_base, audio->time_base);
+			audioPkt->stream_index = audio->index;
+			audioPkt->pos = -1;
+			av_interleaved_write_frame(out, audioPkt);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,123 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <chrono>
+
+#include "spscring.hpp"
+
+// Fixed set of items handed out and given back, so the buffers they hold are allocated once and then reused
+template<typename T>
+class Pool
+{
+public:
+	SpscRing<T*> free; // Items not in use, one stage hands them back here
+
+	void Init(int size)
+	{
+		free.Reset(size);
+		items.clear();
+		for (int i = 0; i < size; i++)
+		{
+			items.emplace_back(new T());
+			free.push(items.back().get());
+		}
+	}
+
+	int Size() { return (int)items.size(); }
+
+	// Waits while all items are in use
+	T* Get() { return free.wait_pop(); }
+	void Put(T* item) { free.push(item); }
+
+private:
+	std::vector<std::unique_ptr<T>> items;
+};
+
+// One step of the frame pipeline: a worker thread that runs work on each item pushed to it, in order, and then hands
+// it to the output queue. Push waits while depth items are queued, so a slow stage holds back the ones feeding it
+// instead of piling up frames. Depth 0 runs work on the pushing thread. Items are pushed from one thread, and ITEM()
+// is reserved for telling the worker to stop
+template<typename ITEM>
+class PipelineStage
+{
+public:
+	std::string name;
+	int depth = 0;
+
+	~PipelineStage() { Stop(); }
+
+	void Start(const std::string& stageName, int queueDepth, std::function<void(ITEM)> stageWork, SpscRing<ITEM>& output)
+	{
+		Stop();
+		name = stageName;
+		depth = std::max(0, queueDepth);
+		work = stageWork;
+		out = &output;
+		queue.Reset(depth);
+		count = 0;
+		busySecs = 0;
+		if (depth > 0)
+			worker = std::thread([this] { Loop(); });
+	}
+
+	void Push(ITEM item)
+	{
+		if (depth == 0)
+		{
+			Run(item);
+			return;
+		}
+		queue.push(item);
+	}
+
+	// Finishes the items already pushed, then ends the worker
+	void Stop()
+	{
+		if (!worker.joinable())
+			return;
+		queue.push(ITEM()); // After the items already queued
+		worker.join();
+	}
+
+	// Time spent in work per item. The pipeline runs about as fast as its slowest stage
+	std::string Stats()
+	{
+		std::ostringstream os;
+		os << name << ": " << count << " frames, " << (count > 0 ? 1000 * busySecs / count : 0) << " ms/frame" << (depth == 0 ? " (inline)" : "");
+		return os.str();
+	}
+
+private:
+	std::function<void(ITEM)> work;
+	SpscRing<ITEM>* out = nullptr;
+	SpscRing<ITEM> queue;
+	std::thread worker;
+	int count = 0;
+	double busySecs = 0;
+
+	void Run(ITEM item)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		work(item);
+		busySecs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		count++;
+		out->push(item);
+	}
+
+	void Loop()
+	{
+		for (ITEM item = queue.wait_pop(); item != ITEM(); item = queue.wait_pop())
+			Run(item);
+	}
+};
@@ -0,0 +1,162 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <list>
+#include <sstream>
+
+#include <opencv2/opencv.hpp>
+
+#include "camparams.hpp"
+#include "config.hpp"
+
+// Fixed-point remap tables (as from cv::convertMaps) kept per quantized camera state, least recently used dropped first
+class RemapCache
+{
+public:
+	struct Key
+	{
+		int yaw = 0, pitch = 0, fov = 0, backOff = 0;
+		bool operator==(const Key& k) const { return yaw == k.yaw && pitch == k.pitch && fov == k.fov && backOff == k.backOff; }
+	};
+
+	struct Entry
+	{
+		Key key;
+		Csp cps; // Camera state the table was built for
+		cv::Mat map1, map2;
+		size_t Bytes() { return map1.total() * map1.elemSize() + map2.total() * map2.elemSize(); }
+	};
+
+	float step = 0.05f;
+	size_t budgetBytes = 256 << 20;
+	int hits = 0, shiftHits = 0, misses = 0;
+
+	void Init(Config& c)
+	{
+		step = c.GetFloat("RemapCacheStep", 0.05f);
+		budgetBytes = (size_t)c.GetInt("RemapCacheMB", 256) << 20;
+		Clear();
+	}
+
+	bool Enabled() { return budgetBytes > 0; }
+
+	void Clear()
+	{
+		entries.clear();
+		usedBytes = 0;
+	}
+
+	// Camera state the table for cps should be built for, so all states sharing a key get the same table
+	Csp Quantize(Csp cps, bool ignoreYaw)
+	{
+		Key k = MakeKey(cps, ignoreYaw);
+		return Csp(ignoreYaw ? cps.Yaw() : k.yaw * step, k.pitch * step, k.fov * step, k.backOff * step);
+	}
+
+	// ignoreYaw: yaw is not part of the key, the caller shifts the table by the yaw difference instead
+	Entry* Find(Csp cps, bool ignoreYaw)
+	{
+		Key k = MakeKey(cps, ignoreYaw);
+		for (auto it = entries.begin(); it != entries.end(); ++it)
+			if (it->key == k)
+			{
+				entries.splice(entries.begin(), entries, it); // Most recently used first
+				hits++;
+				if (ignoreYaw && entries.front().cps.Yaw() != cps.Yaw())
+					shiftHits++;
+				return &entries.front();
+			}
+		misses++;
+		return nullptr;
+	}
+
+	Entry* Add(Csp cps, bool ignoreYaw, cv::Mat map1, cv::Mat map2)
+	{
+		Entry e;
+		e.key = MakeKey(cps, ignoreYaw);
+		e.cps = cps;
+		e.map1 = map1.clone();
+		e.map2 = map2.clone();
+		size_t bytes = e.Bytes();
+
+		while (!entries.empty() && usedBytes + bytes > budgetBytes)
+		{
+			usedBytes -= entries.back().Bytes();
+			entries.pop_back();
+		}
+		if (bytes > budgetBytes)
+			return nullptr;
+
+		usedBytes += bytes;
+		entries.push_front(e);
+		return &entries.front();
+	}
+
+	std::string Stats()
+	{
+		std::ostringstream os;
+		int total = hits + misses;
+		os << "Remap cache: " << hits << " hits (" << shiftHits << " yaw-shifted), " << misses << " misses";
+		if (total > 0)
+			os << ", " << (100 * hits / total) << "% hit rate";
+		os << ", " << entries.size() << " tables, " << (usedBytes >> 20) << " MB, step " << step;
+		return os.str();
+	}
+
+	// Offset source x in a CV_16SC2/CV_16UC1 table pair by shift32 / cv::INTER_TAB_SIZE pixels, wrapping at srcWidth.
+	// Points mapped outside the image (x beyond -1..srcWidth) are left there, wrapping would bring them inside
+	static void ShiftX(const cv::Mat& map1, const cv::Mat& map2, cv::Mat& out1, cv::Mat& out2, int shift32, int srcWidth)
+	{
+		const int ts = cv::INTER_TAB_SIZE;
+		const int w32 = srcWidth * ts;
+		shift32 %= w32;
+
+		out1.create(map1.rows, map1.cols, map1.type());
+		out2.create(map2.rows, map2.cols, map2.type());
+		for (int y = 0; y < map1.rows; y++)
+		{
+			const short* s1 = map1.ptr<short>(y);
+			const ushort* s2 = map2.ptr<ushort>(y);
+			short* d1 = out1.ptr<short>(y);
+			ushort* d2 = out2.ptr<ushort>(y);
+			for (int x = 0; x < map1.cols; x++)
+			{
+				if (s1[2 * x] < -1 || s1[2 * x] > srcWidth)
+				{
+					d1[2 * x] = s1[2 * x];
+					d1[2 * x + 1] = s1[2 * x + 1];
+					d2[x] = s2[x];
+					continue;
+				}
+				int fx = s2[x] & (ts - 1);
+				int X = s1[2 * x] * ts + fx + shift32;
+				X %= w32;
+				if (X < 0) X += w32;
+				d1[2 * x] = (short)(X / ts);
+				d1[2 * x + 1] = s1[2 * x + 1];
+				d2[x] = (ushort)((s2[x] & ~(ts - 1)) | (X & (ts - 1)));
+			}
+		}
+	}
+
+private:
+	std::list<Entry> entries;
+	size_t usedBytes = 0;
+
+	int Q(float v) { return (int)floorf(v / step + 0.5f); }
+
+	Key MakeKey(Csp cps, bool ignoreYaw)
+	{
+		Key k;
+		k.yaw = ignoreYaw ? 0 : Q(cps.Yaw());
+		k.pitch = Q(cps.Pitch());
+		k.fov = Q(cps.Fov());
+		k.backOff = Q(cps.BackOff());
+		return k;
+	}
+};
@@ -10,185 +10,403 @@
 #include <GLFW/glfw3.h>
 
 #include <string>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <filesystem>
+#include <unordered_map>
+#include <random>
+#include <chrono>
 
 #include <glm/glm.hpp>
 
+#include "vrimageformat.hpp"
 
 class Shader
 {
 public:
-	unsigned int ID;
+	unsigned int ID = 0;
+	static const unsigned int CameraBinding = 0; // Uniform buffer binding point of the Camera block, see GlCameraBlock
 
-	void Init(bool uv, bool toImg)
+	// Folder for compiled program binaries, so later runs skip compiling. Empty disables the cache
+	static inline std::string binaryCacheFolder;
+
+	// Program for drawing the source, one variant per combination, all from one template:
+	// toImg: writes vec3 color at location 0 for a render target, else vec4 FragColor
+	// yuv: source is three R8 textures, Y in texture1, U in texture2, V in texture3, converted to RGB here
+	// analytic: no mesh, a full screen triangle where each fragment computes its texture coordinate from the view ray,
+	// exactly as CpuProjection, for the given mapping
+	// The source is sampled through Sample from GlFrameStream's tiled array textures
+	void Init(bool toImg, bool yuv, bool analytic, VrImageGeometryMapping::Type mapping)
 	{
+		const char* blockCode = R"QQ(
+layout(std140) uniform Camera
+{
+	mat4 view;
+	mat4 projection;
+	mat4 rayMatrix;
+	vec4 origin;
+	vec4 halfFov;
+	vec4 fisheyeRect;
+};
+)QQ";
+
 		const char* vShaderCode = R"QQ(
-#version 330 core
+#if ANALYTIC
+void main()
+{
+	vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(p * 2.0 - 1.0, 0, 1);
+}
+#else
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec2 aTexCoord;
 
 out vec2 TexCoord;
 
-uniform mat4 view;
-uniform mat4 projection;
-
 void main()
 {
 	gl_Position = projection * view * vec4(aPos, 1.0f);
-	TexCoord = vec2(aTexCoord.x, aTexCoord.y);
+	TexCoord = aTexCoord;
 }
+#endif
 )QQ";
 
-		const char* fShaderCodeNormal = R"QQ(
-#version 330 core
+		// Project is the same as CpuProjection::Intersect and PointToTex. Sample picks the tile of GlFrameStream
+		// holding texture coordinate tc, scale is 0.5 for chroma planes. YuvToRgb is BT.601 limited range, as
+		// cv::COLOR_YUV2BGR_I420
+		const char* fShaderCode = R"QQ(
+#if TO_IMG
+layout(location = 0) out vec3 color;
+#else
 out vec4 FragColor;
-in vec2 TexCoord;
-uniform sampler2D texture1;
+#endif
 
-void main()
+#if ANALYTIC
+bool Project(out vec2 tc)
 {
-	FragColor = texture(texture1, TexCoord);
-}
-)QQ";
+	const float PI = 3.14159265;
+	vec3 d = mat3(rayMatrix) * vec3(gl_FragCoord.xy, 1);
+	vec3 o = origin.xyz;
+#if MAPPING == 1
+	if (d.z <= 0.0) return false;
+	float t = (1.0 - o.z) / d.z;
+	if (t <= 0.0) return false;
+	vec3 p = o + t * d;
+	float aspect = halfFov.z;
+	tc = vec2((aspect - p.x) / (2.0 * aspect), (1.0 - p.y) / 2.0);
+	return all(greaterThanEqual(tc, vec2(0))) && all(lessThanEqual(tc, vec2(1)));
+#else
+	// Unit sphere, camera is inside so use the far root
+	float a = dot(d, d);
+	float b = dot(o, d);
+	float c = dot(o, o) - 1.0;
+	float disc = b * b - a * c;
+	if (disc < 0.0) return false;
+	float t = (-b + sqrt(disc)) / a;
+	if (t <= 0.0) return false;
+	vec3 p = o + t * d;
 
-		const char* fShaderCodeUV = R"QQ(
-#version 330 core
-out vec4 FragColor;
+	vec2 r = vec2(atan(-p.x, p.z), asin(clamp(-p.y, -1.0, 1.0)));
+	if (abs(r.x) > halfFov.x || abs(r.y) > halfFov.y) return false;
+	tc = (r / halfFov.xy + 1.0) / 2.0;
+#if MAPPING == 3
+	float an = atan(length(p.xy), p.z);
+	float s = sin(an);
+	float sc = s > 1e-6 ? 2.0 * an / (PI * s) : 2.0 / PI;
+	tc = (-p.xy * sc + 1.0) / 2.0;
+	tc = fisheyeRect.xy + tc * fisheyeRect.zw;
+#endif
+	return true;
+#endif
+}
+#else
 in vec2 TexCoord;
-uniform sampler2D texture1;
+#endif
 
-void main()
+uniform vec2 sourceTexels;
+uniform vec2 tileTexels;
+uniform vec2 tileBorder;
+uniform ivec2 tiles;
+
+vec4 Sample(sampler2DArray s, vec2 tc, float scale)
 {
-	FragColor = vec4(TexCoord.x, TexCoord.y, 1, 0);
+	vec2 size = tileTexels * scale;
+	vec2 p = tc * sourceTexels * scale;
+	vec2 t = clamp(floor(p / size), vec2(0), vec2(tiles - 1));
+	vec2 uv = (p - t * size + tileBorder) / (size + 2.0 * tileBorder);
+	return texture(s, vec3(uv, t.y * float(tiles.x) + t.x));
 }
-)QQ";
-
 
-		const char* fShaderCodeNormalToImg = R"QQ(
-#version 330 core
-layout(location = 0) out vec3 color;
-in vec2 TexCoord;
-uniform sampler2D texture1;
+uniform sampler2DArray texture1;
+#if YUV
+uniform sampler2DArray texture2;
+uniform sampler2DArray texture3;
 
-void main()
+vec3 YuvToRgb(vec2 tc)
 {
-	color = vec3(texture(texture1, TexCoord));
+	float y = 1.164 * (Sample(texture1, tc, 1.0).r - 0.0627);
+	float u = Sample(texture2, tc, 0.5).r - 0.502;
+	float v = Sample(texture3, tc, 0.5).r - 0.502;
+	return clamp(vec3(y + 1.596 * v, y - 0.391 * u - 0.813 * v, y + 2.018 * u), 0.0, 1.0);
 }
-)QQ";
-
-		const char* fShaderCodeUVToImg = R"QQ(
-#version 330 core
-layout(location = 0) out vec3 color;
-in vec2 TexCoord;
-uniform sampler2D texture1;
+#endif
 
 void main()
 {
-	color = vec3(TexCoord.x, TexCoord.y, 1);
+#if ANALYTIC
+	vec2 tc;
+	if (!Project(tc))
+		discard; // Background, as outside the mesh
+#else
+	vec2 tc = TexCoord;
+#endif
+
+#if YUV
+	vec3 rgb = YuvToRgb(tc);
+#else
+	vec3 rgb = Sample(texture1, tc, 1.0).rgb;
+#endif
+
+#if TO_IMG
+	color = rgb;
+#else
+	FragColor = vec4(rgb, 1);
+#endif
 }
 )QQ";
 
-		const char* fShaderCode = nullptr;
-		if (!uv && !toImg) fShaderCode = fShaderCodeNormal;
-		if (!uv && toImg) fShaderCode = fShaderCodeNormalToImg;
-		if (uv && !toImg) fShaderCode = fShaderCodeUV;
-		if (uv && toImg) fShaderCode = fShaderCodeUVToImg;
+		std::stringstream defines;
+		defines << "#version 330 core\n"
+			<< "#define TO_IMG " << (int)toImg << "\n"
+			<< "#define YUV " << (int)yuv << "\n"
+			<< "#define ANALYTIC " << (int)analytic << "\n"
+			<< "#define MAPPING " << (int)mapping << "\n";
+		std::string header = defines.str() + blockCode;
 
+		Init((header + vShaderCode).c_str(), (header + fShaderCode).c_str());
+	}
 
-		// 2. compile shaders
-		unsigned int vertex, fragment;
-		// vertex shader
-		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &vShaderCode, NULL);
-		glCompileShader(vertex);
-		checkCompileErrors(vertex, "VERTEX");
-		// fragment Shader
-		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &fShaderCode, NULL);
-		glCompileShader(fragment);
-		checkCompileErrors(fragment, "FRAGMENT");
+	void Init(const char* vShaderCode, const char* fShaderCode)
+	{
+		ID = glCreateProgram();
+		std::string cachePath = BinaryCachePath(vShaderCode, fShaderCode);
+		if (!LoadBinary(cachePath))
+		{
+			// 2. compile shaders
+			unsigned int vertex, fragment;
+			// vertex shader
+			vertex = glCreateShader(GL_VERTEX_SHADER);
+			glShaderSource(vertex, 1, &vShaderCode, NULL);
+			glCompileShader(vertex);
+			checkCompileErrors(vertex, "VERTEX");
+			// fragment Shader
+			fragment = glCreateShader(GL_FRAGMENT_SHADER);
+			glShaderSource(fragment, 1, &fShaderCode, NULL);
+			glCompileShader(fragment);
+			checkCompileErrors(fragment, "FRAGMENT");
 
 
-		// shader Program
-		ID = glCreateProgram();
-		glAttachShader(ID, vertex);
-		glAttachShader(ID, fragment);
-		glLinkProgram(ID);
-		checkCompileErrors(ID, "PROGRAM");
+			// shader Program
+			glAttachShader(ID, vertex);
+			glAttachShader(ID, fragment);
+			if (!cachePath.empty())
+				glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+			glLinkProgram(ID);
+			if (checkCompileErrors(ID, "PROGRAM"))
+				SaveBinary(cachePath);
 
-		// delete the shaders as they're linked into our program now and no longer necessery
-		glDeleteShader(vertex);
-		glDeleteShader(fragment);
+			// delete the shaders as they're linked into our program now and no longer necessery
+			glDetachShader(ID, vertex);
+			glDetachShader(ID, fragment);
+			glDeleteShader(vertex);
+			glDeleteShader(fragment);
+		}
+
+		unsigned int block = glGetUniformBlockIndex(ID, "Camera");
+		if (block != GL_INVALID_INDEX)
+			glUniformBlockBinding(ID, block, CameraBinding);
+		ResolveUniforms();
+	}
+
+	void Delete()
+	{
+		if (ID != 0)
+			glDeleteProgram(ID);
+		ID = 0;
+		uniforms.clear();
 	}
+
 	// activate the shader
 	// ------------------------------------------------------------------------
 	void use() const
 	{
 		glUseProgram(ID);
 	}
+
+	// Location resolved at link time, -1 if the program has no such active uniform
+	int Location(const std::string& name) const
+	{
+		auto it = uniforms.find(name);
+		return it == uniforms.end() ? -1 : it->second;
+	}
+
 	// utility uniform functions
 	// ------------------------------------------------------------------------
 	void setBool(const std::string& name, bool value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+		glUniform1i(Location(name), (int)value);
 	}
 	// ------------------------------------------------------------------------
 	void setInt(const std::string& name, int value) const
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1i(Location(name), value);
 	}
 	// ------------------------------------------------------------------------
 	void setFloat(const std::string& name, float value) const
 	{
-		glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+		glUniform1f(Location(name), value);
 	}
 	// ------------------------------------------------------------------------
 	void setVec2(const std::string& name, const glm::vec2& value) const
 	{
-		glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform2fv(Location(name), 1, &value[0]);
 	}
 	void setVec2(const std::string& name, float x, float y) const
 	{
-		glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+		glUniform2f(Location(name), x, y);
+	}
+	void setIVec2(const std::string& name, int x, int y) const
+	{
+		glUniform2i(Location(name), x, y);
 	}
 	// ------------------------------------------------------------------------
 	void setVec3(const std::string& name, const glm::vec3& value) const
 	{
-		glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform3fv(Location(name), 1, &value[0]);
 	}
 	void setVec3(const std::string& name, float x, float y, float z) const
 	{
-		glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+		glUniform3f(Location(name), x, y, z);
 	}
 	// ------------------------------------------------------------------------
 	void setVec4(const std::string& name, const glm::vec4& value) const
 	{
-		glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+		glUniform4fv(Location(name), 1, &value[0]);
 	}
 	void setVec4(const std::string& name, float x, float y, float z, float w) const
 	{
-		glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+		glUniform4f(Location(name), x, y, z, w);
 	}
 	// ------------------------------------------------------------------------
 	void setMat2(const std::string& name, const glm::mat2& mat) const
 	{
-		glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix2fv(Location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat3(const std::string& name, const glm::mat3& mat) const
 	{
-		glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix3fv(Location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 	// ------------------------------------------------------------------------
 	void setMat4(const std::string& name, const glm::mat4& mat) const
 	{
-		glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		glUniformMatrix4fv(Location(name), 1, GL_FALSE, &mat[0][0]);
 	}
 
 private:
+	std::unordered_map<std::string, int> uniforms;
+
+	void ResolveUniforms()
+	{
+		uniforms.clear();
+		int count = 0, maxLength = 0;
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+		std::vector<char> name(std::max(1, maxLength));
+		for (int i = 0; i < count; i++)
+		{
+			GLint size;
+			GLenum type;
+			glGetActiveUniform(ID, i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+			int location = glGetUniformLocation(ID, name.data());
+			if (location >= 0) // Block members have none
+				uniforms[name.data()] = location;
+		}
+	}
+
+	// Binaries are only valid for the driver that made them, so it is part of the key with the sources
+	std::string BinaryCachePath(const char* vShaderCode, const char* fShaderCode)
+	{
+		GLint formats = 0;
+		if (binaryCacheFolder.empty() || !GLAD_GL_VERSION_4_1)
+			return "";
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		if (formats == 0)
+			return "";
+
+		std::string key = std::string((const char*)glGetString(GL_VENDOR)) + (const char*)glGetString(GL_RENDERER) +
+			(const char*)glGetString(GL_VERSION) + vShaderCode + fShaderCode;
+		std::stringstream name;
+		name << std::hex << std::hash<std::string>()(key) << ".bin";
+		return (std::filesystem::path(binaryCacheFolder) / name.str()).string();
+	}
+
+	bool LoadBinary(const std::string& path)
+	{
+		if (path.empty())
+			return false;
+		std::ifstream f(path, std::ios::binary);
+		GLenum format = 0;
+		if (!f.read((char*)&format, sizeof(format)))
+			return false;
+		std::vector<char> binary((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+		// A driver update can reject it, then it's compiled and saved again
+		glProgramBinary(ID, format, binary.data(), (GLsizei)binary.size());
+		GLint success = 0;
+		glGetProgramiv(ID, GL_LINK_STATUS, &success);
+		return success != 0;
+	}
+
+	void SaveBinary(const std::string& path)
+	{
+		if (path.empty())
+			return;
+		GLint length = 0;
+		glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(ID, length, NULL, &format, binary.data());
+
+		std::error_code ec;
+		std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+		// Written under a name of its own and renamed into place, so an instance loading it at the same time, or after
+		// this one was killed, never gets part of a file
+		std::stringstream tmp;
+		tmp << path << "." << std::hex << std::random_device()() << std::chrono::steady_clock::now().time_since_epoch().count() << ".tmp";
+		bool ok;
+		{
+			std::ofstream f(tmp.str(), std::ios::binary);
+			f.write((const char*)&format, sizeof(format));
+			f.write(binary.data(), binary.size());
+			f.close();
+			ok = !f.fail();
+		}
+		if (ok)
+			std::filesystem::rename(tmp.str(), path, ec);
+		if (!ok || ec)
+			std::filesystem::remove(tmp.str(), ec);
+	}
+
 	// utility function for checking shader compilation/linking errors.
 	// ------------------------------------------------------------------------
-	void checkCompileErrors(GLuint shader, std::string type)
+	bool checkCompileErrors(GLuint shader, std::string type)
 	{
 		GLint success;
 		GLchar infoLog[1024];
@@ -210,6 +428,6 @@ private:
 				std::cout << "ERROR::PROGRAM_LINKING_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
 			}
 		}
+		return success != 0;
 	}
 };
-
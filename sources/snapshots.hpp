@@ -12,6 +12,7 @@
 #include <opencv2/opencv.hpp>
 
 #include "config.hpp"
+#include "videoframe.hpp"
 
 class SnapShots
 {
@@ -33,7 +34,7 @@ public:
 		thumbnailsSheetWidth = c.GetInt("ThumbnailsSheetWidth", 0);
 	}
 
-	void Frame(cv::Mat& img, float secs)
+	void Frame(FrameView img, float secs)
 	{
 		if (thumbnailsImageWidth <= 0 && thumbnailsSheetWidth <= 0)
 			return;
@@ -42,7 +43,8 @@ public:
 		if (secsPerSnapshot > 0 && secsDone >= secsPerSnapshot)
 		{
 			secsDone -= secsPerSnapshot;
-			cv::Mat im = img.clone();
+			cv::Mat im;
+			img.ToBgr(im);
 			snapshots.push_back(im);
 			if (snapshotsPath.size() > 0 && saveSnapshots > 0)
 			{
@@ -0,0 +1,174 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <iostream>
+
+#include "blockingqueue.hpp"
+
+// Bounded queue for exactly one pushing and one popping thread. Push and pop touch only their own index and read the
+// other's, each on its own cache line, so neither takes a lock while there is room or something to take. A side that
+// has to wait spins a little, as the other side is usually about to act, then parks on a condition variable that is
+// only signalled when someone is parked
+template<typename ITEM>
+class SpscRing
+{
+public:
+	static const int CacheLine = 64;
+	static const int SpinCount = 200; // Checks before parking, the last ones yielding
+
+	SpscRing(int capacity = 0) { Reset(capacity); }
+
+	// Not thread safe, only while neither side is running
+	void Reset(int capacity)
+	{
+		slots.assign(std::max(1, capacity), ITEM());
+		head.v = 0;
+		tail.v = 0;
+	}
+
+	int Capacity() { return (int)slots.size(); }
+
+	bool try_push(const ITEM& value)
+	{
+		size_t t = tail.v.load(std::memory_order_relaxed);
+		if (t - head.v.load() >= slots.size())
+			return false;
+		slots[t % slots.size()] = value;
+		tail.v.store(t + 1);
+		Wake();
+		return true;
+	}
+
+	// Waits while full
+	void push(const ITEM& value)
+	{
+		if (try_push(value))
+			return;
+		Wait([&] { return tail.v.load(std::memory_order_relaxed) - head.v.load() < slots.size(); });
+		try_push(value);
+	}
+
+	bool try_pop(ITEM& value)
+	{
+		size_t h = head.v.load(std::memory_order_relaxed);
+		if (h == tail.v.load())
+			return false;
+		value = slots[h % slots.size()];
+		head.v.store(h + 1);
+		Wake();
+		return true;
+	}
+
+	// Waits while empty
+	ITEM wait_pop()
+	{
+		ITEM value{};
+		if (try_pop(value))
+			return value;
+		Wait([&] { return head.v.load(std::memory_order_relaxed) != tail.v.load(); });
+		try_pop(value);
+		return value;
+	}
+
+	bool empty() { return head.v.load() == tail.v.load(); }
+
+	// From the popping side
+	void clear()
+	{
+		ITEM item;
+		while (try_pop(item));
+	}
+
+private:
+	struct alignas(CacheLine) Index { std::atomic<size_t> v{ 0 }; };
+	Index head; // Next to pop, written by the popping thread
+	Index tail; // Next to push, written by the pushing thread
+	alignas(CacheLine) std::vector<ITEM> slots;
+
+	alignas(CacheLine) std::atomic<int> parked{ 0 };
+	std::mutex mutex;
+	std::condition_variable wake;
+
+	template<typename F>
+	void Wait(F ready)
+	{
+		for (int i = 0; i < SpinCount; i++)
+		{
+			if (ready())
+				return;
+			if (i >= SpinCount / 2)
+				std::this_thread::yield();
+		}
+		parked++;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, ready);
+		}
+		parked--;
+	}
+
+	// Index stores and parked are sequentially consistent, so either the waiter sees the new index or we see it parked
+	void Wake()
+	{
+		if (parked.load() == 0)
+			return;
+		std::lock_guard<std::mutex> lock(mutex);
+		wake.notify_all();
+	}
+};
+
+// Items passed around a pool of depth buffers between two threads, the way frames go from the decoder to the render
+// loop and back, through SpscRing and through BlockingQueue. Prints ns per item
+inline void BenchmarkQueues(int items = 1000000)
+{
+	auto run = [&](auto& full, auto& free, int depth)
+	{
+		std::vector<int> pool(depth);
+		for (int i = 0; i < depth; i++)
+			free.push(&pool[i]);
+
+		auto t0 = std::chrono::steady_clock::now();
+		std::thread producer([&]
+		{
+			for (int i = 0; i < items; i++)
+			{
+				int* p = free.wait_pop();
+				*p = i;
+				full.push(p);
+			}
+		});
+		long long sum = 0;
+		for (int i = 0; i < items; i++)
+		{
+			int* p = full.wait_pop();
+			sum += *p;
+			free.push(p);
+		}
+		producer.join();
+		free.clear();
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / items;
+		return sum == (long long)items * (items - 1) / 2 ? ns : -1;
+	};
+
+	std::cout << "Queue benchmark: " << items << " items between two threads" << std::endl;
+	for (int depth : { 2, 4, 8, 32 })
+	{
+		SpscRing<int*> ringFull(depth), ringFree(depth);
+		BlockingQueue<int*> queueFull, queueFree;
+		double nsRing = run(ringFull, ringFree, depth);
+		double nsQueue = run(queueFull, queueFree, depth);
+		std::cout << "Depth " << depth << ": SpscRing " << 0.1f * (int)(nsRing * 10) << " ns/item, BlockingQueue "
+			<< 0.1f * (int)(nsQueue * 10) << " ns/item" << std::endl;
+	}
+}
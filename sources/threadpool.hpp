@@ -0,0 +1,203 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+// Runs numTasks indexed tasks on a fixed set of threads, the calling thread included. Each worker starts with
+// a contiguous range of task indices and takes from its front; a worker that runs dry steals the back half of
+// the largest remaining range, so uneven task costs are balanced without any per-task scheduling up front.
+class WorkStealingPool
+{
+public:
+	WorkStealingPool(int numThreads = 0) { Start(numThreads); }
+	~WorkStealingPool() { Stop(); }
+
+	int NumThreads() { return (int)ranges.size(); }
+	std::atomic<int> steals = 0; // Total since start, for diagnostics
+
+	// numThreads <= 0: one per hardware thread
+	void Start(int numThreads)
+	{
+		Stop();
+		if (numThreads <= 0)
+			numThreads = (int)std::thread::hardware_concurrency();
+		if (numThreads <= 0)
+			numThreads = 1;
+
+		ranges.clear();
+		for (int i = 0; i < numThreads; i++)
+			ranges.emplace_back(new Range());
+
+		quit = false;
+		for (int i = 1; i < numThreads; i++)
+			threads.emplace_back([this, i] { WorkerLoop(i); });
+	}
+
+	void Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (auto& t : threads)
+			t.join();
+		threads.clear();
+	}
+
+	// Calls task(i) for i in 0..numTasks-1 and returns when all are done
+	void Run(int numTasks, std::function<void(int)> task)
+	{
+		int n = NumThreads();
+		if (n == 1 || numTasks <= 1)
+		{
+			for (int i = 0; i < numTasks; i++)
+				task(i);
+			return;
+		}
+
+		for (int w = 0; w < n; w++)
+		{
+			std::lock_guard<std::mutex> lock(ranges[w]->mutex);
+			ranges[w]->begin = (int)((long long)numTasks * w / n);
+			ranges[w]->end = (int)((long long)numTasks * (w + 1) / n);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			curTask = &task;
+			remaining = numTasks;
+			generation++;
+		}
+		wake.notify_all();
+
+		Work(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return remaining == 0 && active == 0; });
+		curTask = nullptr;
+	}
+
+private:
+	struct Range
+	{
+		std::mutex mutex;
+		int begin = 0, end = 0;
+	};
+
+	std::vector<std::unique_ptr<Range>> ranges;
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	std::function<void(int)>* curTask = nullptr;
+	int remaining = 0; // Tasks not yet finished in current Run
+	int active = 0; // Workers inside Work()
+	long long generation = 0;
+	bool quit = false;
+
+	bool PopOwn(int w, int& task)
+	{
+		Range& r = *ranges[w];
+		std::lock_guard<std::mutex> lock(r.mutex);
+		if (r.begin >= r.end)
+			return false;
+		task = r.begin++;
+		return true;
+	}
+
+	// Moves the back half of the largest other range to worker w
+	bool Steal(int w)
+	{
+		int n = NumThreads();
+		int victim = -1, most = 0;
+		for (int k = 1; k < n; k++)
+		{
+			int v = (w + k) % n;
+			int size;
+			{
+				std::lock_guard<std::mutex> lock(ranges[v]->mutex);
+				size = ranges[v]->end - ranges[v]->begin;
+			}
+			if (size > most) { most = size; victim = v; }
+		}
+		if (victim < 0)
+			return false;
+
+		int b, e;
+		{
+			Range& r = *ranges[victim];
+			std::lock_guard<std::mutex> lock(r.mutex);
+			int size = r.end - r.begin;
+			if (size <= 0)
+				return true; // Emptied since we looked, look again
+			e = r.end;
+			b = r.end - (size + 1) / 2;
+			r.end = b;
+		}
+		{
+			Range& r = *ranges[w];
+			std::lock_guard<std::mutex> lock(r.mutex);
+			r.begin = b;
+			r.end = e;
+		}
+		steals++;
+		return true;
+	}
+
+	void Work(int w)
+	{
+		std::function<void(int)>& task = *curTask;
+		int finished = 0;
+		for (;;)
+		{
+			int t;
+			if (PopOwn(w, t))
+			{
+				task(t);
+				finished++;
+			}
+			else if (!Steal(w))
+				break;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		remaining -= finished;
+		if (remaining == 0)
+			done.notify_all();
+	}
+
+	void WorkerLoop(int w)
+	{
+		long long seen = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return quit || (generation != seen && curTask != nullptr); });
+				if (quit)
+					return;
+				seen = generation;
+				active++;
+			}
+
+			Work(w);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			active--;
+			if (active == 0)
+				done.notify_all();
+		}
+	}
+};
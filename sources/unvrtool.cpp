@@ -36,7 +36,7 @@ Options:
 -sc | -script				 Allow user to setup camera shots first, esc to stop.
 -sl | -scriptload <path>	 Loads script from path. If not specified will look for <file>.uvrtscript
 -ss | -scriptsave <path>	 Saves script to path. If not specified will use <file>.uvrtscript
--sa | -saveaudio             After save, use ffmpeg to create a video with audio from source-video.
+-sa | -saveaudio             After save, use ffmpeg to create a video with audio from source-video (OutBackend = libav copies it in while saving).
 -sak| -saveaudiokeep         Don't delete no-audio video after audio save
 -t  | -to <path>             Save video to path, implies -s
 -tf | -tofolder <path>       Save video(s) to folder, implies -s
@@ -142,6 +142,12 @@ int main(int argc, char** argv)
 		if (opt == "--dbgfmtimg")
 			H(c.saveDebugFormatImage = true);
 
+		if (opt == "--benchrender")
+			H(CpuRenderTarget::Benchmark(c));
+
+		if (opt == "--benchqueue")
+			H(BenchmarkQueues());
+
 		//-cr | -configreset           Reset all config values
 		if (opt == "-cr" || opt == "-configreset")
 			H(c = Config(cr));
@@ -0,0 +1,183 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include "videoframe.hpp"
+#include "util.hpp"
+
+// The video backend VideoInput's decoder thread reads from. Frames are numbered from 0, errors are thrown
+class VideoDecoder
+{
+public:
+	double fps = 0;
+	int width = 0, height = 0;
+	int frameCount = 0;
+	PixelFormat pixelFormat = PixelFormat::BGR; // What Retrieve delivers, valid after the first Retrieve
+	bool zeroCopy = false; // Retrieve hands out the decoder's own planes instead of filling VideoFrame::Frame
+
+	virtual ~VideoDecoder() {}
+
+	virtual bool Open(const std::string& path, bool wantI420) = 0;
+
+	// Decodes the next frame, false at the end of the video
+	virtual bool Grab() = 0;
+
+	// Number of the frame Grab decoded last
+	virtual int Position() = 0;
+
+	// The frame Grab decoded last, into vf
+	virtual void Retrieve(VideoFrame* vf) = 0;
+
+	// Grabs frame, so Retrieve returns it
+	virtual void Seek(int frame) = 0;
+
+	virtual void Close() = 0;
+};
+
+// cv::VideoCapture, with whatever backend OpenCV picks
+class CvDecoder : public VideoDecoder
+{
+public:
+	cv::VideoCapture cap;
+	std::string yuvLayout = "auto"; // auto, i420 or nv12, see InputYuvLayout in config. Set before Open
+
+	bool Open(const std::string& path, bool wantI420) override
+	{
+		cap.setExceptionMode(true);
+		try
+		{
+			cap.open(path);
+		}
+		catch (...)
+		{
+			std::cerr << what();
+		}
+		if (!cap.isOpened())
+			return false;
+
+		fps = cap.get(cv::CAP_PROP_FPS);
+		width = (int)cap.get(cv::CAP_PROP_FRAME_WIDTH);
+		height = (int)cap.get(cv::CAP_PROP_FRAME_HEIGHT);
+		frameCount = (int)cap.get(cv::CAP_PROP_FRAME_COUNT);
+		requestI420 = wantI420;
+		if (requestI420)
+		{
+			try { cap.set(cv::CAP_PROP_CONVERT_RGB, false); }
+			catch (...) {}
+		}
+		return true;
+	}
+
+	bool Grab() override { return cap.grab(); }
+
+	int Position() override { return (int)cap.get(cv::CAP_PROP_POS_FRAMES) - 1; } // get returns *next* frame number..
+
+	void Retrieve(VideoFrame* vf) override
+	{
+		vf->Owner.reset();
+		if (nv12)
+			RetrieveNv12(vf->Frame);
+		else
+			cap.retrieve(vf->Frame);
+		if (!formatSet)
+			SetFormat(vf->Frame);
+		vf->Format = pixelFormat;
+	}
+
+	// Setting CAP_PROP_POS_FRAMES fails now and then near the end of long files, so retry a bit earlier
+	void Seek(int frame) override
+	{
+		cap.set(cv::CAP_PROP_POS_FRAMES, frame);
+		int errCnt = 0;
+		bool ok = false;
+		while (!ok && errCnt < 5)
+		{
+			try
+			{
+				cap.grab();
+				ok = true;
+			}
+			catch (...)
+			{
+				errCnt++;
+				if (frame > 0 && frame > frameCount - 1000)
+				{
+					int q = 2 * (errCnt * errCnt);
+					frame -= q;
+					cap.set(cv::CAP_PROP_POS_FRAMES, frame);
+				}
+			}
+		}
+	}
+
+	void Close() override
+	{
+		if (cap.isOpened())
+			cap.release();
+	}
+
+private:
+	bool requestI420 = false;
+	bool formatSet = false;
+	bool nv12 = false; // The backend delivers NV12, its UV plane is split into U and V
+	cv::Mat raw;
+
+	// Keep the decoder's YUV 4:2:0 output if the backend can deliver it, otherwise fall back to BGR. I420 and NV12 are
+	// the same size, so the layout comes from the backend or from config, never from the size alone
+	void SetFormat(cv::Mat& m)
+	{
+		bool yuv = requestI420 && m.type() == CV_8UC1 && m.cols == width && m.rows == height * 3 / 2 && width % 2 == 0 && height % 2 == 0;
+		std::string layout = yuv ? YuvLayout() : "";
+		bool i420 = layout == "i420" || layout == "nv12";
+		if (!i420 && m.type() != CV_8UC3)
+		{
+			cap.set(cv::CAP_PROP_CONVERT_RGB, true);
+			cap.retrieve(m);
+		}
+		else if (layout == "nv12")
+		{
+			nv12 = true;
+			RetrieveNv12(m);
+		}
+		pixelFormat = i420 ? PixelFormat::I420 : PixelFormat::BGR;
+		formatSet = true;
+		if (requestI420)
+			std::cout << "Decoding to " << (i420 ? "I420" + std::string(nv12 ? " from NV12" : "") :
+				yuv ? "BGR, backend doesn't tell its YUV layout, see InputYuvLayout" : "BGR, backend has no YUV output") << std::endl;
+	}
+
+	// yuvLayout, or for auto the pixel format the backend reports (CAP_PROP_CODEC_PIXEL_FORMAT, OpenCV 4.5.2 on).
+	// "" if neither says
+	std::string YuvLayout()
+	{
+		if (yuvLayout != "auto")
+			return yuvLayout;
+		int fourcc = 0;
+		try { fourcc = (int)cap.get(46); }
+		catch (...) {}
+		if (fourcc == cv::VideoWriter::fourcc('I', '4', '2', '0') || fourcc == cv::VideoWriter::fourcc('I', 'Y', 'U', 'V'))
+			return "i420";
+		if (fourcc == cv::VideoWriter::fourcc('N', 'V', '1', '2'))
+			return "nv12";
+		return "";
+	}
+
+	// Y plane as is, the interleaved UV plane split into the U and V planes of an I420 frame
+	void RetrieveNv12(cv::Mat& frame)
+	{
+		cap.retrieve(raw);
+		frame.create(raw.rows, raw.cols, CV_8UC1);
+		FrameView dst = FrameView::FromI420(frame);
+		raw(cv::Rect(0, 0, width, height)).copyTo(dst.y);
+		cv::Mat uv(height / 2, width / 2, CV_8UC2, raw.ptr(height), raw.step[0]);
+		cv::Mat planes[2] = { dst.u, dst.v };
+		cv::split(uv, planes);
+	}
+};
@@ -0,0 +1,77 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <opencv2/opencv.hpp>
+#include "config.hpp"
+#include "videoframe.hpp"
+
+// The video backend VideoOutput's encode thread writes to
+class VideoEncoder
+{
+public:
+	bool hasAudio = false; // The source audio is copied into the file, see Open
+
+	virtual ~VideoEncoder() {}
+
+	// audioSource: video whose audio goes into the file too, from c.timeStartSec to c.timeEndSec. Backends that can't
+	// copy audio leave hasAudio false
+	virtual bool Open(Config& c, const std::string& path, double fps, cv::Size size, const std::string& audioSource) = 0;
+	virtual bool IsOpen() = 0;
+	virtual void Write(FrameView frame) = 0;
+
+	// Writes what the encoder still holds and finishes the file
+	virtual void Close() = 0;
+};
+
+// cv::VideoWriter, set up with OutFOURCC and OutQuality
+class CvEncoder : public VideoEncoder
+{
+public:
+	cv::VideoWriter vw;
+	cv::Mat bgr; // cv::VideoWriter only takes BGR, so I420 frames are converted back here
+
+	bool Open(Config& c, const std::string& path, double fps, cv::Size size, const std::string& audioSource) override
+	{
+		//int fourcc = cv::VideoWriter::fourcc('h','v','c','1');
+		//int fourcc = cv::VideoWriter::fourcc('X','V','I','D');
+		//int fourcc = cv::VideoWriter::fourcc( M','P','4','2');
+		//int fourcc = cv::VideoWriter::fourcc('X','2','6','4');
+		//int fourcc = cv::VideoWriter::fourcc('m', 'p', '4', 'v');
+
+		std::string fcc = c.GetString("OutFOURCC", "mp4v");
+		int fourcc = cv::VideoWriter::fourcc(fcc[0], fcc[1], fcc[2], fcc[3]);
+		int outQuality = c.GetInt("OutQuality", -1);
+
+		vw.open(path, fourcc, fps, size);
+		if (outQuality != -1)
+			vw.set(cv::VIDEOWRITER_PROP_QUALITY, outQuality);
+		//auto q = vw.get(cv::VIDEOWRITER_PROP_QUALITY);
+		//std::cout << "VW Q " << q << std::endl;
+		return vw.isOpened();
+	}
+
+	bool IsOpen() override { return vw.isOpened(); }
+
+	void Write(FrameView frame) override
+	{
+		if (frame.Format == PixelFormat::BGR)
+			vw.write(frame.bgr);
+		else
+		{
+			frame.ToBgr(bgr);
+			vw.write(bgr);
+		}
+	}
+
+	void Close() override
+	{
+		vw.release();
+	}
+};
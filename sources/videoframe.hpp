@@ -8,6 +8,7 @@
 
 #include <string>
 #include <sstream>
+#include <memory>
 
 #include <opencv2/opencv.hpp>
 
@@ -71,7 +72,110 @@ struct TimeCode
 	TimeCodeHMS GetHms() { return TimeCodeHMS(FrameNo / Fps); }
 };
 
+enum class PixelFormat { BGR, I420 };
+
+// A decoded frame, or a rectangle of one. BGR: bgr is CV_8UC3. I420: y is full size, u and v half size in both directions
+struct FrameView
+{
+	PixelFormat Format = PixelFormat::BGR;
+	cv::Mat bgr, y, u, v;
+
+	cv::Size Size() { return Format == PixelFormat::I420 ? y.size() : bgr.size(); }
+
+	// The BGR image or the Y plane. What the tracker and markers work on
+	cv::Mat Base() { return Format == PixelFormat::I420 ? y : bgr; }
+
+	void ToBgr(cv::Mat& out)
+	{
+		if (Format == PixelFormat::BGR)
+		{
+			bgr.copyTo(out);
+			return;
+		}
+		// cvtColor needs the planes packed in one buffer
+		if (IsPacked())
+		{
+			cv::cvtColor(cv::Mat(y.rows * 3 / 2, y.cols, CV_8UC1, y.data), out, cv::COLOR_YUV2BGR_I420);
+			return;
+		}
+		cv::Mat packed(y.rows * 3 / 2, y.cols, CV_8UC1);
+		y.copyTo(packed(cv::Rect(0, 0, y.cols, y.rows)));
+		u.copyTo(cv::Mat(u.rows, u.cols, CV_8UC1, packed.ptr(y.rows)));
+		v.copyTo(cv::Mat(v.rows, v.cols, CV_8UC1, packed.ptr(y.rows) + u.total()));
+		cv::cvtColor(packed, out, cv::COLOR_YUV2BGR_I420);
+	}
+
+	// I420 planes back to back in one buffer, as FromI420 of a whole frame
+	bool IsPacked() { return y.isContinuous() && u.isContinuous() && u.data == y.data + y.total() && v.data == u.data + u.total(); }
+
+	static FrameView FromBgr(cv::Mat m)
+	{
+		FrameView v;
+		v.bgr = m;
+		return v;
+	}
+
+	// I420 buffer as produced by cv::COLOR_BGR2YUV_I420 or a decoder: Y plane followed by the U and V planes
+	static FrameView FromI420(cv::Mat m)
+	{
+		FrameView fv;
+		fv.Format = PixelFormat::I420;
+		int w = m.cols, h = m.rows * 2 / 3;
+		fv.y = m(cv::Rect(0, 0, w, h));
+		fv.u = cv::Mat(h / 2, w / 2, CV_8UC1, m.ptr(h));
+		fv.v = cv::Mat(h / 2, w / 2, CV_8UC1, m.ptr(h) + (w / 2) * (h / 2));
+		return fv;
+	}
+
+	FrameView Sub(cv::Rect r)
+	{
+		FrameView s;
+		s.Format = Format;
+		if (Format == PixelFormat::BGR)
+			s.bgr = bgr(r);
+		else
+		{
+			cv::Rect rc(r.x / 2, r.y / 2, r.width / 2, r.height / 2);
+			s.y = y(r);
+			s.u = u(rc);
+			s.v = v(rc);
+		}
+		return s;
+	}
+};
+
 struct VideoFrame : TimeCode
 {
-	cv::Mat Frame;
+	PixelFormat Format = PixelFormat::BGR;
+	cv::Mat Frame; // BGR: CV_8UC3. I420: CV_8UC1 with height * 3 / 2 rows, see FrameView::FromI420
+	int BufferIndex = -1; // Frame decodes into VideoInput::SetFrameBuffers buffer, if set
+	int Dropped = 0; // Frames grabbed but not retrieved before this one to keep up with the playback clock
+	int Generation = 0; // Seeks requested before it was decoded, see VideoInput::GetFrame
+
+	// Set instead of Frame by a decoder that hands out its own planes, see VideoDecoder::zeroCopy. Owner keeps them alive
+	// until the frame is decoded into again
+	FrameView Planes;
+	std::shared_ptr<void> Owner;
+
+	FrameView View()
+	{
+		if (Owner)
+			return Planes;
+		return Format == PixelFormat::I420 ? FrameView::FromI420(Frame) : FrameView::FromBgr(Frame);
+	}
+	FrameView View(cv::Rect r) { return View().Sub(r); }
+
+	// The decoder may still read planes it handed out, as reference for later frames, so copy them before drawing on them
+	void MakeWritable()
+	{
+		if (!Owner)
+			return;
+		int w = Planes.y.cols, h = Planes.y.rows;
+		Frame.create(h * 3 / 2, w, CV_8UC1);
+		FrameView own = FrameView::FromI420(Frame);
+		Planes.y.copyTo(own.y);
+		Planes.u.copyTo(own.u);
+		Planes.v.copyTo(own.v);
+		Owner.reset();
+	}
 };
\ No newline at end of file
@@ -6,37 +6,133 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <sstream>
 #include <opencv2/opencv.hpp>
 #include "videoframe.hpp"
-#include "blockingqueue.hpp"
+#include "videodecoder.hpp"
+#include "lav_decoder.hpp"
+#include "spscring.hpp"
 #include "util.hpp"
 
 class VideoInput
 {
+public:
+	// Time from taking a seek request to having the frame decoded
+	struct SeekTimes
+	{
+		int count = 0;
+		double totalSecs = 0, longestSecs = 0, lastSecs = 0;
+	};
+
 private:
 	int setNextFrame = -1;
-	cv::VideoCapture cap;
+	std::unique_ptr<VideoDecoder> dec;
 
-	bool capRun = true;
-	bool capRunning = false;
+	std::atomic<bool> capRun{ true }; // Also read by the decoder outside stateMutex, see Close
+	std::atomic<bool> capRunning{ false };
 
-	BlockingQueue<VideoFrame*> frame_capt;
-	BlockingQueue<VideoFrame*> frame_free;
+	// Only the decoder pushes to frame_capt and takes from frame_free, only the caller does the opposite. Frames from
+	// before a seek are dropped by GetFrame, the decoder never takes frames back
+	SpscRing<VideoFrame*> frame_capt;
+	SpscRing<VideoFrame*> frame_free;
+	std::vector<std::unique_ptr<VideoFrame>> frames;
 	std::thread* captThread = nullptr;
 	std::string path;
+	int numFrames;
+
+	std::mutex bufferMutex;
+	std::vector<cv::Mat> frameBuffers;
+	int nextBuffer = 0;
+
+	// The decoder waits on this while paused, see SetPause
+	std::mutex stateMutex;
+	std::condition_variable stateChanged;
+	int refresh = 0;
+	int seekGeneration = 0; // Seeks requested, frames decoded before the last one have a lower VideoFrame::Generation
+	SeekTimes seekTimes; // Added to by the decoder thread
+
+	// Playback clock, frame clockFrame is due at clockStart. Restarted by the first Present after a seek, an unpause
+	// or a speed change
+	std::chrono::steady_clock::time_point clockStart;
+	int clockFrame = -1;
+	int clockSpeed = 1;
+
+	// Seconds until frame is due on the playback clock, negative when late. 0 without a running clock
+	double DueIn(int frame)
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		if (!realtime || clockFrame < 0)
+			return 0;
+		double due = (frame - clockFrame) / (fps * clockSpeed);
+		return due - std::chrono::duration<double>(std::chrono::steady_clock::now() - clockStart).count();
+	}
+
+	// Next frame would be shown more than a frame interval late, so it is grabbed without being retrieved
+	bool IsLate(int frame)
+	{
+		return !pause && frame + 1 < frameCount && DueIn(frame) < -1 / fps;
+	}
+
+	void Notify(std::function<void()> change)
+	{
+		{
+			std::lock_guard<std::mutex> lock(stateMutex);
+			change();
+		}
+		stateChanged.notify_all();
+	}
 
 public:
 	int frameSpeed = 1;
 	double fps = 0;
 	int width=0, height=0;
 	int frameCount = 0;
-	bool pause = false;
+	std::atomic<bool> pause{ false }; // Set with SetPause, under stateMutex for the decoder waiting on it
 	int curframeNo;
 
-	VideoInput()
+	bool realtime = false; // Pace frames by their timestamps and drop late ones, see Present
+	std::atomic<long long> droppedFrames{ 0 }; // Added to by the decoder thread
+
+	SeekTimes Seeks()
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		return seekTimes;
+	}
+
+	bool requestI420 = false; // Ask the decoder for planar YUV 4:2:0 instead of BGR, set before Open
+	std::string backend = "opencv"; // opencv or libav, see VideoBackend in config. Set before Open
+	std::string yuvLayout = "auto"; // opencv only, see InputYuvLayout in config
+	int decodeThreads = 0; // libav only, 0 lets libavcodec decide
+	std::string decodeThreading = "frame,slice";
+	std::string keyframeIndex = "sidecar"; // libav only, see KeyframeIndex in config
+	PixelFormat pixelFormat = PixelFormat::BGR; // What frames are delivered as, valid after Open
+
+	VideoInput(int poolSize = 2)
 	{
-		frame_free.push(new VideoFrame());
-		frame_free.push(new VideoFrame());
+		numFrames = poolSize;
+		frame_capt.Reset(numFrames);
+		frame_free.Reset(numFrames);
+		for (int i = 0; i < numFrames; i++)
+		{
+			frames.emplace_back(new VideoFrame());
+			frame_free.push(frames.back().get());
+		}
+	}
+
+	int NumFrames() { return numFrames; }
+
+	// Frame sized Mats the frames decode into from now on, one per frame, e.g. mapped GL upload buffers. Each frame
+	// takes one the next time it is decoded into
+	void SetFrameBuffers(std::vector<cv::Mat> buffers)
+	{
+		std::lock_guard<std::mutex> lock(bufferMutex);
+		frameBuffers = buffers;
+		nextBuffer = 0;
 	}
 
 	float SecsPerImage()
@@ -54,7 +150,51 @@ public:
 	{
 		if (frame < 0) frame = 0;
 		if (frame >= frameCount) frame = frameCount - 2;
-		setNextFrame = frame; 
+		Notify([&] { setNextFrame = frame; seekGeneration++; clockFrame = -1; });
+	}
+
+	// While paused the decoder sleeps instead of retrieving the same frame over and over, until unpaused, asked to
+	// seek, or asked by Refresh to deliver the current frame once more
+	void SetPause(bool p)
+	{
+		if (p != pause)
+			Notify([&] { pause = p; clockFrame = -1; });
+	}
+
+	// Waits until frame is due on the playback clock, starting the clock if it isn't running. Frames that are late
+	// already return at once, the decoder drops the following ones until it has caught up
+	void Present(int frame)
+	{
+		if (!realtime || pause || frame < 0)
+			return;
+		int speed = std::max(1, frameSpeed);
+		{
+			std::lock_guard<std::mutex> lock(stateMutex);
+			if (clockFrame < 0 || clockSpeed != speed)
+			{
+				clockStart = std::chrono::steady_clock::now();
+				clockFrame = frame;
+				clockSpeed = speed;
+				return;
+			}
+		}
+		double wait = DueIn(frame);
+		if (wait > 0)
+			std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+	}
+
+	// One more copy of the current frame, unless one is already waiting. For redrawing it while paused
+	void Refresh()
+	{
+		Notify([&] { if (frame_capt.empty()) refresh++; });
+	}
+
+	std::string SeekStats()
+	{
+		auto s = Seeks();
+		std::ostringstream os;
+		os << "Seeks: " << s.count << ", " << (s.count > 0 ? (int)(1000 * s.totalSecs / s.count) : 0) << " ms average, " << (int)(1000 * s.longestSecs) << " ms longest";
+		return os.str();
 	}
 
 	bool IsRunning() 
@@ -64,24 +204,62 @@ public:
 
 	bool _DoOpen()
 	{
-		cap.setExceptionMode(true);
-		try
+		dec.reset();
+		if (backend == "libav")
 		{
-			cap.open(path);
+#if defined(UNVR_WITH_LIBAV)
+			auto lav = new LavDecoder();
+			lav->threads = decodeThreads;
+			lav->frameThreads = decodeThreading.find("frame") != std::string::npos;
+			lav->sliceThreads = decodeThreading.find("slice") != std::string::npos;
+			lav->keyframeIndex = keyframeIndex;
+			dec.reset(lav);
+#else
+			std::cout << "VideoBackend = libav needs a build with UNVR_WITH_LIBAV, using opencv" << std::endl;
+#endif
 		}
-		catch (...)
+		if (!dec)
 		{
-			std::cerr << what();
+			auto opencv = new CvDecoder();
+			opencv->yuvLayout = yuvLayout;
+			dec.reset(opencv);
 		}
-		return cap.isOpened();
+		return dec->Open(path, requestI420);
+	}
+
+	// Allocates every frame in the pool at the decoded size, so retrieve writes into it without reallocating. Called by
+	// the decoder once the format is known, while the other frames are still unused
+	void _DoPreallocate()
+	{
+		if (dec->zeroCopy && frameBuffers.empty())
+			return;
+		int rows = pixelFormat == PixelFormat::I420 ? height * 3 / 2 : height;
+		int type = pixelFormat == PixelFormat::I420 ? CV_8UC1 : CV_8UC3;
+		for (auto& f : frames)
+			f->Frame.create(rows, width, type);
+	}
+
+	void _DoAttachBuffer(VideoFrame* vf)
+	{
+		std::lock_guard<std::mutex> lock(bufferMutex);
+		if (vf->BufferIndex < 0 && nextBuffer < (int)frameBuffers.size())
+		{
+			vf->BufferIndex = nextBuffer;
+			vf->Frame = frameBuffers[nextBuffer++]; // retrieve reuses it as long as size and type match
+		}
+	}
+
+	void _DoRetrieve(VideoFrame* vf)
+	{
+		dec->Retrieve(vf);
 	}
 
 	void _DoClose()
 	{
 		try
 		{
-			if (cap.isOpened())
-				cap.release();
+			if (dec)
+				dec->Close();
 		}
 		catch(...) 
 		{
@@ -96,7 +274,9 @@ public:
 		{
 			if (capRunning)
 			{
-				capRun = false;
+				Notify([&] { capRun = false; });
+				// A decoder waiting for a free frame takes this one and stops. If the ring is full it is not waiting
+				frame_free.try_push(nullptr);
 				for(int i=0; i<50 && capRunning; i++)
 					std::this_thread::sleep_for(std::chrono::milliseconds(10));
 
@@ -125,79 +305,84 @@ public:
 				else
 				{
 					capRunning = true;
-					fps = cap.get(cv::CAP_PROP_FPS);
-					width = cap.get(cv::CAP_PROP_FRAME_WIDTH);
-					height = cap.get(cv::CAP_PROP_FRAME_HEIGHT);
-
-					frameCount = (int)cap.get(cv::CAP_PROP_FRAME_COUNT);
-					cap.grab();
+					fps = dec->fps;
+					width = dec->width;
+					height = dec->height;
+					frameCount = dec->frameCount;
+					dec->Grab();
 
-					int frameNo = (int)cap.get(cv::CAP_PROP_POS_FRAMES) - 1; // get returns *next* frame number..
+					int frameNo = dec->Position();
 					vf->SetTimeCode(fps, frameNo);
-					cap.retrieve(vf->Frame);
+					dec->Retrieve(vf);
+					pixelFormat = dec->pixelFormat;
+					_DoPreallocate();
 					frame_capt.push(vf);
 
 					// Add it again since the first is consumed by status check
 					vf = frame_free.wait_pop();
-					vf->SetTimeCode(fps, frameNo);
-					cap.retrieve(vf->Frame);
-					frame_capt.push(vf);
+					if (vf == nullptr)
+						capRun = false;
+					else
+					{
+						vf->SetTimeCode(fps, frameNo);
+						_DoRetrieve(vf);
+						frame_capt.push(vf);
+					}
 
+					int generation = 0;
 					while (capRun)
 					{
+						int seekTo = -1;
+						{
+							std::unique_lock<std::mutex> lock(stateMutex);
+							stateChanged.wait(lock, [&] { return !capRun || !pause || setNextFrame != -1 || refresh > 0; });
+							refresh = std::max(0, refresh - 1);
+							std::swap(seekTo, setNextFrame);
+							if (seekTo != -1)
+								generation = seekGeneration;
+						}
+						if (!capRun)
+							break;
+
 						auto vf = frame_free.wait_pop();
+						if (vf == nullptr || !capRun)
+							break; // Closed while waiting, the decoder may be gone
+						vf->Dropped = 0;
+						vf->Generation = generation;
+						_DoAttachBuffer(vf);
 
 						try
 						{
-							if (setNextFrame != -1)
+							if (seekTo != -1)
 							{
-								// Flush all captured frames
-								while (frame_capt.try_pop(vf))
-									frame_free.push(vf);
-
-								if (setNextFrame >= frameCount)
-									setNextFrame = frameCount - 2;
-								curframeNo = setNextFrame;
-								setNextFrame = -1;
-								cap.set(cv::CAP_PROP_POS_FRAMES, curframeNo);
-								int errCnt = 0;
-								bool ok = false;
-								while (!ok && errCnt < 5)
-								{
-									try
-									{
-										cap.grab();
-										ok = true;
-									}
-									catch (...)
-									{
-										errCnt++;
-										if (curframeNo > 0 && curframeNo > frameCount - 1000)
-										{
-											int q = 2 * (errCnt * errCnt);
-											curframeNo -= q;
-											cap.set(cv::CAP_PROP_POS_FRAMES, curframeNo);
-										}
-									}
-								}
+								if (seekTo >= frameCount)
+									seekTo = frameCount - 2;
+								auto t0 = std::chrono::steady_clock::now();
+								dec->Seek(seekTo);
+								double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+								std::lock_guard<std::mutex> lock(stateMutex);
+								seekTimes.lastSecs = secs;
+								seekTimes.totalSecs += secs;
+								seekTimes.longestSecs = std::max(seekTimes.longestSecs, secs);
+								seekTimes.count++;
 							}
 							else
 							{
 								for (int skip = 0; !pause && skip < frameSpeed; skip++)
-									cap.grab(); // advance frame
+									dec->Grab(); // advance frame
+
+								// Late frames skip the costly retrieve, but at least one per second is shown
+								while (realtime && vf->Dropped < fps && IsLate(dec->Position()) && dec->Grab())
+									vf->Dropped++;
+								droppedFrames += vf->Dropped;
 							}
 
-							curframeNo = (int)cap.get(cv::CAP_PROP_POS_FRAMES) - 1; // get returns *next* frame number..
+							curframeNo = dec->Position();
 							if (curframeNo >= frameCount)
 								vf->SetTimeCode(fps, -1);
 							else
 							{
-								cap.retrieve(vf->Frame);
-								if (setNextFrame != -1)
-								{
-									frame_free.push(vf);
-									continue;
-								}
+								_DoRetrieve(vf);
 								vf->SetTimeCode(fps, curframeNo);
 							}
 						}
@@ -226,14 +411,28 @@ public:
 		return ok;
 	}
 
+	bool HasFrame() { return !frame_capt.empty(); }
+
+	// The next frame decoded since the last seek, frames decoded before it go back to the pool
 	VideoFrame* GetFrame()
 	{
-		if (!capRunning)
+		while (true)
 		{
-			if (frame_capt.empty())
-				return nullptr;
+			if (!capRunning)
+			{
+				if (frame_capt.empty())
+					return nullptr;
+			}
+			VideoFrame* f = frame_capt.wait_pop();
+			int generation;
+			{
+				std::lock_guard<std::mutex> lock(stateMutex);
+				generation = seekGeneration;
+			}
+			if (f->Generation == generation)
+				return f;
+			ReleaseFrame(f);
 		}
-		return frame_capt.wait_pop();
 	}
 
 	void ReleaseFrame(VideoFrame* frame)
@@ -6,27 +6,46 @@
 
 #pragma once
 
+#include <memory>
 #include <opencv2/opencv.hpp>
 #include "config.hpp"
 #include "util.hpp"
+#include "videoframe.hpp"
+#include "videoencoder.hpp"
+#include "lav_encoder.hpp"
+#include "pipeline.hpp"
 
+// Encodes on its own thread, so the render loop only waits when the encoder falls EncodeQueueDepth frames behind
 class VideoOutput
 {
 public:
-	cv::VideoWriter vw;
+	std::unique_ptr<VideoEncoder> enc;
 
-	void Start(Config& c, std::string path, double fps, cv::Size size)
+	struct Buffer
+	{
+		cv::Mat img;
+		PixelFormat format = PixelFormat::BGR;
+	};
+	Pool<Buffer> buffers;
+	PipelineStage<Buffer*> encoder;
+
+	// OutBackend = libav in a build that has it, so Start can take the source audio
+	static bool CopiesAudio(Config& c)
+	{
+#if defined(UNVR_WITH_LIBAV)
+		return c.GetString("OutBackend", "opencv") == "libav";
+#else
+		return false;
+#endif
+	}
+
+	std::string filePath; // As opened, with OutExt
+
+	// audioSource: video whose audio is copied in, if the backend can, see HasAudio. A libav writer that fails to open
+	// falls back to opencv. False if no writer could open path
+	bool Start(Config& c, std::string path, double fps, cv::Size size, const std::string& audioSource = "")
 	{
-		//int fourcc = cv::VideoWriter::fourcc('h','v','c','1');
-		//int fourcc = cv::VideoWriter::fourcc('X','V','I','D');
-		//int fourcc = cv::VideoWriter::fourcc( M','P','4','2');
-		//int fourcc = cv::VideoWriter::fourcc('X','2','6','4');
-		//int fourcc = cv::VideoWriter::fourcc('m', 'p', '4', 'v');
-
-		std::string fcc = c.GetString("OutFOURCC", "mp4v");
-		int fourcc = cv::VideoWriter::fourcc(fcc[0], fcc[1], fcc[2], fcc[3]);
 		std::string outExt = c.GetString("OutExt", ".mp4");
-		int outQuality = c.GetInt("OutQuality", -1);
 		std::filesystem::path p(path);
 		if (!p.has_extension() || p.extension().string() != outExt)
 		{
@@ -34,22 +53,70 @@ public:
 			path = p.string();
 		}
 
-		vw.open(path, fourcc, fps, size);
-		if (outQuality != -1)
-			vw.set(cv::VIDEOWRITER_PROP_QUALITY, outQuality);
-		//auto q = vw.get(cv::VIDEOWRITER_PROP_QUALITY);
-		//std::cout << "VW Q " << q << std::endl;
+		// Done with any earlier file before its encoder goes
+		encoder.Stop();
+		if (enc)
+			enc->Close();
+		enc.reset();
+		bool ok = false;
+		if (c.GetString("OutBackend", "opencv") == "libav")
+		{
+#if defined(UNVR_WITH_LIBAV)
+			enc.reset(new LavEncoder());
+			ok = enc->Open(c, path, fps, size, audioSource);
+			if (!ok)
+			{
+				std::cout << "Unable to write " << path << " with libav, using opencv" << std::endl;
+				enc.reset();
+			}
+#else
+			std::cout << "OutBackend = libav needs a build with UNVR_WITH_LIBAV, using opencv" << std::endl;
+#endif
+		}
+		if (!enc)
+		{
+			enc.reset(new CvEncoder());
+			ok = enc->Open(c, path, fps, size, audioSource);
+		}
+		if (!ok)
+			std::cout << "Unable to write " << path << std::endl;
+		filePath = path;
+
+		int depth = std::max(0, c.GetInt("EncodeQueueDepth", 4));
+		buffers.Init(depth + 1);
+		encoder.Start("Encode " + p.filename().string(), depth, [this](Buffer* b) { Encode(b); }, buffers.free);
+		return ok;
 	}
 
-	void Write(cv::Mat& frame)
+	// The source audio is in the file, no need to mux it in afterwards
+	bool HasAudio() { return enc && enc->hasAudio; }
+
+	// Hands img to the encoder and takes a buffer it is done with in its place, for the caller to draw into next.
+	// Waits while the encoder is behind
+	void Write(cv::Mat& img, PixelFormat format)
 	{
-		if (vw.isOpened())
-			vw.write(frame);
+		if (!enc || !enc->IsOpen())
+			return;
+		Buffer* b = buffers.Get();
+		std::swap(b->img, img);
+		b->format = format;
+		encoder.Push(b);
 	}
 
+	// Encodes what is queued before closing the file
 	void Close()
 	{
-		vw.release();
+		encoder.Stop();
+		if (enc)
+			enc->Close();
+	}
+
+	std::string Stats() { return encoder.Stats(); }
+
+private:
+	void Encode(Buffer* b)
+	{
+		enc->Write(b->format == PixelFormat::BGR ? FrameView::FromBgr(b->img) : FrameView::FromI420(b->img));
 	}
 };
 
@@ -93,7 +93,8 @@ VrImageFormat::Detect(int confirmations, VideoInput* cap)
 			for (int s = 0; s < 10; s++)
 				cap->SkipFrame();
 			VideoFrame* f = cap->GetFrame();
-			cv::Mat mc = f->Frame.clone();
+			cv::Mat mc;
+			f->View().ToBgr(mc);
 			cap->ReleaseFrame(f);
 			return mc;
 		});
@@ -47,8 +47,8 @@ VrRecorder::VrRecorder(Config& config) : c(config)
 bool
 VrRecorder::OpenWindow()
 {
-	GlInit();
-	window = glfwCreateWindow(scrSize.width, scrSize.height, "UnVR Tool", NULL, NULL);
+	if (GlInit())
+		window = glfwCreateWindow(scrSize.width, scrSize.height, "UnVR Tool", NULL, NULL);
 	if (window == NULL)
 	{
 		std::cout << "Failed to create GLFW window" << std::endl;
@@ -65,6 +65,7 @@ VrRecorder::OpenWindow()
 	glfwSetCursorPosCallback(window, [](GLFWwindow* w, double xpos, double ypos) { static_cast<VrRecorder*>(glfwGetWindowUserPointer(w))->mouse_callback(w, xpos, ypos); });
 	glfwSetMouseButtonCallback(window, [](GLFWwindow* w, int button, int action, int mods) { static_cast<VrRecorder*>(glfwGetWindowUserPointer(w))->button_callback(w, button, action, mods); });
 	glfwSetScrollCallback(window, [](GLFWwindow* w, double xoffset, double yoffset) { static_cast<VrRecorder*>(glfwGetWindowUserPointer(w))->scroll_callback(w, xoffset, yoffset); });
+	glfwSetWindowRefreshCallback(window, [](GLFWwindow* w) { static_cast<VrRecorder*>(glfwGetWindowUserPointer(w))->redraw = true; });
 
 	glfwSetInputMode(window, GLFW_CURSOR, captMouse ? GLFW_CURSOR_DISABLED : GLFW_CURSOR_NORMAL);
 
@@ -74,14 +75,138 @@ VrRecorder::OpenWindow()
 		return false;
 	}
 
-	glEnable(GL_DEPTH_TEST);
-	shaderN.Init(false, false);
-	shaderUv.Init(true, false);
-	shaderN2map.Init(false, true);
-	shaderUv2map.Init(true, true);
+	return true;
+}
+
+// Context with no visible window, for -save without -view or -script. Nothing is drawn to a default framebuffer.
+// auto is a hidden window where there is a display, EGL where there is none or the window fails
+bool
+VrRecorder::OpenOffscreen(const std::string& api)
+{
+	offscreen = true;
+	if (api == "egl" || (api == "auto" && !GlHasDisplay()))
+	{
+		if (!GlInitEgl())
+			return false;
+	}
+	else
+	{
+		if (GlInit(false, api == "osmesa" ? GLFW_OSMESA_CONTEXT_API : GLFW_NATIVE_CONTEXT_API))
+			window = glfwCreateWindow(recWidth, recHeight, "UnVR Tool", NULL, NULL);
+		if (window == NULL)
+		{
+			std::cout << "Failed to create offscreen GLFW context (" << api << ")" << std::endl;
+			glfwTerminate();
+			return api == "auto" && GlInitEgl();
+		}
+		glfwMakeContextCurrent(window);
+
+		if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+		{
+			std::cout << "Failed to initialize GLAD" << std::endl;
+			return false;
+		}
+	}
+
 	return true;
 }
 
+void
+VrRecorder::GlInitShaders()
+{
+	glEnable(GL_DEPTH_TEST);
+
+	std::string cache = c.GetString("ShaderCache", "temp");
+	std::error_code ec;
+	if (cache == "temp")
+		cache = (std::filesystem::temp_directory_path(ec) / "unvrtool-shaders").string();
+	Shader::binaryCacheFolder = cache == "none" || ec ? "" : cache;
+
+	shaderN2map = &shaders.Get(true, yuvInput, geom);
+}
+
+void
+VrRecorder::GlGenerateTextures(cv::Size size)
+{
+	PixelFormat format = yuvInput ? PixelFormat::I420 : PixelFormat::BGR;
+	frameStream.maxTextureSize = c.GetInt("MaxTextureSize", 0);
+	auto buffers = frameStream.Init(format, size.width, size.height, cv::Size(vidIn->width, vidIn->height), vidIn->NumFrames());
+	vidIn->SetFrameBuffers(buffers);
+	if (frameStream.persistent)
+		std::cout << "Decoding into " << buffers.size() << " mapped upload buffers" << std::endl;
+	if (frameStream.tilesX * frameStream.tilesY > 1)
+		std::cout << "Source exceeds the max texture size (see MaxTextureSize), split into " << frameStream.tilesX << "x" << frameStream.tilesY << " tiles" << std::endl;
+
+	shaderN2map->use();
+	frameStream.SetUniforms(*shaderN2map);
+	shaderN2map->setInt("texture1", 0);
+	if (yuvInput)
+	{
+		shaderN2map->setInt("texture2", 1);
+		shaderN2map->setInt("texture3", 2);
+	}
+}
+
+void
+VrRecorder::UploadFrame(FrameView view)
+{
+	// YUV: one R8 texture per plane, converted to RGB in the shader
+	if (!uploadVisible)
+	{
+		frameStream.Upload(view);
+		return;
+	}
+
+	// Extra views need their parts too
+	std::vector<cv::Rect> rects;
+	for (size_t i = 0; i <= views.size(); i++)
+	{
+		uploadProj.Set(i == 0 ? cam : views[i - 1]->cam, geom, recWidth, recHeight);
+		auto r = uploadProj.VisibleRegion(view.Base().size(), CpuProjection::WrapsX(geom));
+		rects.insert(rects.end(), r.begin(), r.end());
+	}
+	frameStream.Upload(view, rects);
+}
+
+void
+VrRecorder::StartPipeline()
+{
+	// The debug image is uploaded right after the frame it was made from, so the tracker runs inline for it
+	int trackDepth = camTracker.EnableDebugTexure ? 0 : std::max(0, c.GetInt("TrackQueueDepth", 1));
+	trackJobs.Init(trackDepth + 2); // Queued, being tracked, and the result a frame behind
+	tracked.Reset(trackJobs.Size());
+	track.Start("Track", trackDepth, [&](TrackJob* job)
+	{
+		camTracker.Process(job->crop, job->frames);
+		job->target = camTracker.curTarget;
+	}, tracked);
+	trackTarget = camTracker.curTarget;
+	trackPending = 0;
+}
+
+// Takes tracker results until at most keep jobs are left in flight
+void
+VrRecorder::FinishTracking(int keep)
+{
+	while (trackPending > keep)
+	{
+		TrackJob* job = tracked.wait_pop();
+		trackTarget = job->target;
+		job->crop = cv::Mat(); // Refers to a frame that goes back to the decoder
+		trackJobs.Put(job);
+		trackPending--;
+	}
+}
+
+// Snapshots see the image before it goes to the encoder, which hands back a used buffer for the renderer to draw into
+void
+VrRecorder::WriteOutput(cv::Mat& img, PixelFormat format)
+{
+	if (!scriptmode)
+		snapshots->Frame(format == PixelFormat::I420 ? FrameView::FromI420(img) : FrameView::FromBgr(img), vidIn->SecsPerImage());
+	vidOut->Write(img, format);
+}
+
 void
 VrRecorder::StartScriptMode()
 {
@@ -116,6 +241,13 @@ VrRecorder::ExitScriptCamMode()
 	}
 
 	pause = false;
+	// Frames still in the readback rings were drawn in script mode
+	if (useGl)
+	{
+		rt.Discard();
+		for (auto& v : views)
+			v->rt.Discard();
+	}
 	StartNormalMode();
 }
 
@@ -138,7 +270,10 @@ VrRecorder::StartNormalMode()
 
 	if (c.save)
 	{
-		std::string opath = videopath + ".unvr.vid.mp4";
+		// The libav writer copies the audio in as it goes, straight to the final file. Otherwise PostProcess muxes it
+		bool copyAudio = c.saveaudio && VideoOutput::CopiesAudio(c);
+		std::string suffix = copyAudio ? ".unvr.mp4" : ".unvr.vid.mp4";
+		std::string opath = videopath + suffix;
 		if (c.outPath != "")
 			opath = c.outPath;
 		if (c.outFolder != "")
@@ -146,10 +281,82 @@ VrRecorder::StartNormalMode()
 			std::filesystem::path p(videopath);
 			auto fn = p.filename();
 			p = std::filesystem::path(c.outFolder);
-			opath = (p / fn).string() + ".unvr.vid.mp4";
+			opath = (p / fn).string() + suffix;
+		}
+
+		vidOut->Start(c, opath, vidIn->fps, cv::Size(recWidth, recHeight), copyAudio ? videopath : "");
+		// Not if the writer fell back to opencv or found no audio, PostProcess then takes the file as written
+		audioInline = vidOut->HasAudio();
+
+		// <output>.<name><ext> for each extra view
+		for (auto& v : views)
+		{
+			std::filesystem::path p(opath);
+			std::string ext = p.has_extension() ? p.extension().string() : c.GetString("OutExt", ".mp4");
+			p.replace_extension();
+			p += "." + v->name + ext;
+			v->out.Start(c, p.string(), vidIn->fps, cv::Size(recWidth, recHeight));
+			std::cout << "View " << v->name << " saved to " << p.string() << std::endl;
+		}
+	}
+}
+
+// Views = name:yaw,pitch,fov,backoff for a fixed camera or name:track,fov,backoff for one following the tracker,
+// separated by |
+void
+VrRecorder::InitViews()
+{
+	std::string defs = c.GetString("Views", "");
+	if (defs.empty() || !c.save)
+		return;
+	if (!useGl)
+	{
+		std::cout << "Views need Renderer = gl, ignored" << std::endl;
+		return;
+	}
+
+	std::stringstream ss(defs);
+	std::string def;
+	while (std::getline(ss, def, '|'))
+	{
+		std::vector<std::string> vals;
+		size_t colon = def.find(':');
+		if (colon != std::string::npos)
+		{
+			std::stringstream vs(def.substr(colon + 1));
+			for (std::string v; std::getline(vs, v, ',');)
+				vals.push_back(v);
 		}
 
-		vidOut->Start(c, opath, vidIn->fps, cv::Size(recWidth, recHeight));
+		auto view = std::make_unique<View>();
+		view->track = !vals.empty() && vals[0] == "track";
+		size_t n = view->track ? 3 : 4;
+		if (colon == 0 || colon == std::string::npos || vals.size() != n)
+		{
+			std::cout << "Ignoring view \"" << def << "\", expected name:yaw,pitch,fov,backoff or name:track,fov,backoff" << std::endl;
+			continue;
+		}
+		view->name = def.substr(0, colon);
+
+		Camera& vc = view->cam;
+		vc.Init(c, vidIn->fps);
+		try
+		{
+			if (!view->track)
+			{
+				vc.Set(Cp::Yaw, std::stof(vals[0]), 7);
+				vc.Set(Cp::Pitch, std::stof(vals[1]), 7);
+			}
+			vc.Set(Cp::Fov, std::stof(vals[n - 2]), 7);
+			vc.Set(Cp::Bo, std::stof(vals[n - 1]), 7);
+		}
+		catch (const std::exception&)
+		{
+			std::cout << "Ignoring view \"" << def << "\", values must be numbers" << std::endl;
+			continue;
+		}
+		vc.UpdateCps();
+		views.push_back(std::move(view));
 	}
 }
 
@@ -175,7 +382,7 @@ VrRecorder::CheckScript(cv::Mat subFrame)
 	bool ypSet = last.HasYaw();
 	bool fbSet = last.HasFov();
 
-	YawPitch yp = ypSet ? last.YP() : camTracker.curTarget;
+	YawPitch yp = ypSet ? last.YP() : trackTarget;
 	auto tp = ucv::Conv(geom.CalcTexFromYawPitch(yp));
 
 	if (showMarkers)
@@ -204,8 +411,14 @@ VrRecorder::CheckScript(cv::Mat subFrame)
 int
 VrRecorder::Run(VrImageFormat vrFormat)
 {
-	vidIn = new VideoInput();
+	vidIn = new VideoInput(std::max(1, c.GetInt("DecodeQueueDepth", 2)) + 2); // Plus the frame being drawn and the one whose upload is in flight
 	vidOut = new VideoOutput();
+	vidIn->requestI420 = c.GetString("InputPixelFormat", "i420") == "i420";
+	vidIn->backend = c.GetString("VideoBackend", "opencv");
+	vidIn->yuvLayout = c.GetString("InputYuvLayout", "auto");
+	vidIn->decodeThreads = c.GetInt("DecodeThreads", 0);
+	vidIn->decodeThreading = c.GetString("DecodeThreading", "frame,slice");
+	vidIn->keyframeIndex = c.GetString("KeyframeIndex", "sidecar");
 
 	if (!vidIn->Open(videopath))
 		return -1;
@@ -260,54 +473,113 @@ VrRecorder::Run(VrImageFormat vrFormat)
 	}
 
 
+	useGl = true;
+	if (c.GetString("Renderer", "gl") == "cpu")
+	{
+		if (c.save && !c.view && !c.scriptcam)
+			useGl = false;
+		else
+			std::cout << "Renderer = cpu only applies to -save without -view or -script, using gl" << std::endl;
+	}
+
+	InitViews();
+
+	// Watching without saving plays at the video's own speed, dropping frames the renderer can't keep up with
+	vidIn->realtime = useGl && !c.save && c.GetString("Playback", "realtime") == "realtime";
+
 	if (c.scriptcam)
 		StartScriptMode();
 	else
 		StartNormalMode();
 
-	if (!OpenWindow())
+	yuvInput = vidIn->pixelFormat == PixelFormat::I420;
+	outI420 = c.GetString("OutPixelFormat", "bgr") == "i420";
+	if (outI420 && (recWidth % 2 != 0 || recHeight % 2 != 0))
+	{
+		std::cout << "OutPixelFormat = i420 needs even Width and Height, using bgr" << std::endl;
+		outI420 = false;
+	}
+	PixelFormat outFormat = outI420 ? PixelFormat::I420 : PixelFormat::BGR;
+	std::string glContext = c.GetString("GlContext", "auto");
+	bool saveOnly = c.save && !c.view && !c.scriptcam;
+	if (glContext == "auto")
+		glContext = saveOnly ? "auto" : "window";
+	else if (glContext != "window" && !saveOnly)
+	{
+		std::cout << "GlContext = " << glContext << " only applies to -save without -view or -script, using window" << std::endl;
+		glContext = "window";
+	}
+
+	geom.analytic = c.GetString("GlProjection", "analytic") == "analytic";
+	if (useGl && !(glContext == "window" ? OpenWindow() : OpenOffscreen(glContext)))
 		return -1;
 
 	geom.Set(vrFormat.GeomType, vrFormat.FovX, vrFormat.FovY);
 	if (vrFormat.GeomType == VrImageGeometryMapping::Type::Fisheye)
 		geom.fisheyeEllipseRect = vrFormat.fisheyeEllipseRects[0];
-	geom.GlGenerate();
-
-	unsigned int texture1 = glGenTexture();
-
-	shaderN.use();
-	shaderN.setInt("texture1", 0);
-	shaderN2map.use();
-	shaderN2map.setInt("texture1", 0);
-
 
-	rt.Init(shaderN2map, GlRenderTarget::Type::RGB8, recWidth, recHeight);
-	rtUv.Init(shaderUv2map, GlRenderTarget::Type::Uv16, recWidth, recHeight);
-	rt.backColor = c.GetBackgroundColor();
+	if (useGl)
+	{
+		GlInitShaders();
+		geom.GlGenerate();
+		GlGenerateTextures(vrFormat.GetSubImg(channel).size());
+		uploadVisible = c.GetString("UploadRegion", "visible") == "visible";
+
+		rt.Init(*shaderN2map, outI420 ? GlRenderTarget::Type::I420 : GlRenderTarget::Type::RGB8, recWidth, recHeight, c.GetInt("ReadbackLatency", 2));
+		rt.backColor = backgroundColor;
+		for (auto& v : views)
+		{
+			v->rt.Init(*shaderN2map, rt.type, recWidth, recHeight, rt.latency);
+			v->rt.backColor = c.GetBackgroundColor();
+		}
+	}
+	else
+	{
+		rtCpu.Init(c, recWidth, recHeight, outFormat);
+		rtCpu.backColor = c.GetBackgroundColor();
+		camTracker.EnableDebugTexure = false; // Shown through the GL source texture
+	}
+	auto renderOutput = [&]() { return useGl ? rt.Output() : rtCpu.Output(); };
+	auto writeRender = [&]() { WriteOutput(useGl ? rt.renderImg : rtCpu.renderImg, renderOutput().Format); };
+	StartPipeline();
 
 	int cnt = 0;
 	int cntMod = 10;
 	auto t1 = std::chrono::high_resolution_clock::now();
 
-	Shader* shader = &shaderN;
-
 	if (c.saveDebugFormatImage)
 	{
 		cv::Rect r = vrFormat.GetSubImg(channel);
 		cv::Mat& frame = vrFormat.lastFrameAnalyzed;
-		cv::Mat subFrame = frame(r);
+		cv::Mat frameI420;
+		FrameView view = FrameView::FromBgr(frame);
+		if (yuvInput)
+		{
+			cv::cvtColor(frame, frameI420, cv::COLOR_BGR2YUV_I420);
+			view = FrameView::FromI420(frameI420);
+		}
+		FrameView subView = view.Sub(r);
 
-		glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.cols);
-		for (int f = 0; f < 2; f++)
-		{ // 1 frame lag in drawing?
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, r.width, r.height, 0, GL_BGR, GL_UNSIGNED_BYTE, subFrame.data);
-			rt.Draw(texture1, cam, geom);
+		if (useGl)
+		{
+			for (int f = 0; f < 2; f++)
+			{ // 1 frame lag in drawing?
+				frameStream.Upload(subView);
+				rt.Draw(frameStream.textures[0], cam, geom);
+			}
+			while (rt.Flush())
+				;
 		}
-		vrFormat.SaveDebugInputImages(videopath.c_str(), &frame, &rt.renderImg);
+		else
+			rtCpu.Draw(subView, cam, geom);
+		cv::Mat renderBgr;
+		renderOutput().ToBgr(renderBgr);
+		vrFormat.SaveDebugInputImages(videopath.c_str(), &frame, &renderBgr);
 	}
 
 
-	while (!glfwWindowShouldClose(window))
+	VideoFrame* uploadedFrame = nullptr;
+	while (!useGl || offscreen || !glfwWindowShouldClose(window))
 	{
 		if (trgExitScriptCamMode)
 		{
@@ -315,7 +587,17 @@ VrRecorder::Run(VrImageFormat vrFormat)
 			ExitScriptCamMode();
 		}
 
-		vidIn->pause = pause;
+		// Paused with nothing changed would draw the same image again, so wait for input instead
+		if (pause && !offscreen && useGl && !NeedsRedraw())
+		{
+			glfwWaitEventsTimeout(0.1);
+			processInput(window);
+			continue;
+		}
+
+		vidIn->SetPause(pause);
+		if (pause)
+			vidIn->Refresh(); // The decoder sleeps while paused
 		curframe = vidIn->GetFrame();
 
 		if (curframe == nullptr)
@@ -335,30 +617,75 @@ VrRecorder::Run(VrImageFormat vrFormat)
 
 		curTimeCode = TimeCode(*curframe);
 
-		cv::Mat& frame = curframe->Frame;
+		if (showMarkers)
+			curframe->MakeWritable(); // Markers are drawn into the frame
 		cv::Rect r = vrFormat.GetSubImg(channel);
-		cv::Mat subFrame = frame(r);
+		FrameView subView = curframe->View(r);
+		bool trackingCur = false; // A job for this frame is in the tracker
+		cv::Mat subFrame = subView.Base(); // Y plane for YUV frames
 
 		if (!pause)
 		{
+			// Media time since the last frame, including frames dropped to keep up with the playback clock
+			int frames = vidIn->frameSpeed + curframe->Dropped;
+			float secs = (float)(frames / vidIn->fps);
+
+			// The frame is tracked while it is drawn, the camera follows the result from the frame before
 			if (vrFormat.GeomType != VrImageGeometryMapping::Type::Flat)
-				camTracker.Process(subFrame);
+			{
+				TrackJob* job = trackJobs.Get();
+				job->crop = subFrame;
+				job->frames = 1 + curframe->Dropped;
+				track.Push(job);
+				trackPending++;
+				trackingCur = true;
+			}
+			FinishTracking(1);
+			if (showMarkers)
+				FinishTracking(0); // Markers are drawn into the frame the tracker reads
 
 			auto* si = script.GetBefore(curTimeCode.FrameNo + 1);
 			if (si && !si->IsEmpty())
 				cam.Set(*si, 4); // Set target
 
 			if (!si || !si->HasYaw())
-				cam.SetTarget(camTracker.curTarget);
+				cam.SetTarget(trackTarget);
+
+			cam.MoveCam(secs, frames);
 
-			cam.MoveCam(vidIn->SecsPerImage(), vidIn->frameSpeed);
+			for (auto& v : views)
+			{
+				if (v->track)
+					v->cam.SetTarget(trackTarget);
+				v->cam.MoveCam(secs, frames);
+			}
 		}
 
 		CheckScript(subFrame);
-		glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.cols);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, r.width, r.height, 0, GL_BGR, GL_UNSIGNED_BYTE, subFrame.data);
-
-		vidIn->ReleaseFrame(curframe);
+		if (useGl)
+		{
+			// Input can move the camera, so it is handled before the visible region is picked for the upload
+			if (!offscreen)
+				processInput(window);
+
+			// The GPU may still be reading the frame's upload buffer, so it goes back to the decoder a frame later
+			UploadFrame(subView);
+			if (camTracker.EnableDebugTexure && !camTracker.dbgImg.empty())
+				frameStream.UploadDebug(camTracker.dbgImg);
+			if (uploadedFrame != nullptr)
+			{
+				FinishTracking(trackingCur ? 1 : 0);
+				frameStream.Wait(uploadedFrame);
+				vidIn->ReleaseFrame(uploadedFrame);
+			}
+			uploadedFrame = curframe;
+		}
+		else
+		{
+			rtCpu.Draw(subView, cam, geom); // Samples the frame directly, so must be done before it is released
+			FinishTracking(0);
+			vidIn->ReleaseFrame(curframe);
+		}
 		curframe = nullptr;
 
 		if (cnt++ % cntMod == 0)
@@ -372,44 +699,89 @@ VrRecorder::Run(VrImageFormat vrFormat)
 			float cp = 0.01f * (int)(cam.cps.Pitch() * 100);
 			float cf = 0.1f * (int)(cam.cps.Fov() * 10);
 			float cb = 0.1f * (int)(cam.cps.BackOff() * 10);
-			std::cout << curTimeCode.GetHms().ToString() << " / " << tt.ToString() << "  " << cfps << " fps   Fov: " << cf << "  Bo: " << cb << "   Pos: " << cy << " | " << cp << "   \r";
+			std::cout << curTimeCode.GetHms().ToString() << " / " << tt.ToString() << "  " << cfps << " fps   Fov: " << cf << "  Bo: " << cb << "   Pos: " << cy << " | " << cp;
+			if (vidIn->realtime)
+				std::cout << "   Dropped: " << vidIn->droppedFrames.load();
+			auto seeks = vidIn->Seeks();
+			if (seeks.count > 0)
+				std::cout << "   Seek: " << (int)(1000 * seeks.lastSecs) << " ms";
+			std::cout << "   \r";
 		}
 
-		processInput(window);
+		bool haveOutput = true; // The gl renderer delivers frames ReadbackLatency draws later
+		if (useGl)
+		{
+			rt.backColor = backgroundColor; // Script mode's color only shows on screen, ExitScriptCamMode discards its frames
+			haveOutput = rt.Draw(frameStream.textures[0], cam, geom);
+			// View outputs are started with the main output, by StartNormalMode
+			if (!scriptmode)
+				for (auto& v : views)
+					if (v->rt.Draw(frameStream.textures[0], v->cam, geom))
+						v->out.Write(v->rt.renderImg, v->rt.Output().Format);
+		}
 
-		rt.Draw(texture1, cam, geom);
-		vidOut->Write(rt.renderImg);
-		if (!scriptmode)
-			snapshots->Frame(rt.renderImg, vidIn->SecsPerImage());
+		if (haveOutput)
+			writeRender();
 
-		rtUv.Draw(texture1, cam, geom);
+		if (!useGl || offscreen)
+			continue; // The screen only matters with a visible window
 
-		shader->use();
-		glViewport(0, 0, scrSize.width, scrSize.height);
-		glClearColor(backgroundColor.r, backgroundColor.g, backgroundColor.b, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		vidIn->Present(curTimeCode.FrameNo);
+		rt.Present(scrSize.width, scrSize.height);
+		redraw = false;
+		drawnCps = cam.cps;
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+	}
 
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, texture1);
+	while (useGl && rt.Flush())
+		writeRender();
 
-		glm::mat4 projection = glm::perspective(glm::radians(cam.fov()), (scrSize.width / (float)scrSize.height), 0.1f, 100.0f);
-		shader->setMat4("projection", projection);
-		glm::mat4 view = cam.CalcView();
-		shader->setMat4("view", view);
+	for (auto& v : views)
+		while (v->rt.Flush())
+			v->out.Write(v->rt.renderImg, v->rt.Output().Format);
 
-		geom.GlDraw();
+	for (auto& v : views)
+		v->out.Close();
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+	FinishTracking(0);
+	track.Stop();
+	if (uploadedFrame != nullptr)
+	{
+		frameStream.Wait(uploadedFrame);
+		vidIn->ReleaseFrame(uploadedFrame);
 	}
 
 	vidIn->Close();
 	vidOut->Close();
 
+	if (c.GetInt("PrintStats", 0) != 0)
+	{
+		if (!useGl && rtCpu.useRemap)
+			std::cout << std::endl << rtCpu.cache.Stats() << std::endl;
+		std::cout << std::endl << track.Stats() << std::endl;
+		if (c.save)
+			std::cout << vidOut->Stats() << std::endl;
+	}
+	if (vidIn->realtime)
+		std::cout << std::endl << "Dropped " << vidIn->droppedFrames.load() << " frames to keep up with playback" << std::endl;
+	if (vidIn->Seeks().count > 0)
+		std::cout << vidIn->SeekStats() << std::endl;
+	if (useGl && uploadVisible && frameStream.pixelsOffered > 0)
+		std::cout << std::endl << "Uploaded " << (int)(100 * frameStream.pixelsUploaded / frameStream.pixelsOffered) << "% of source pixels" << std::endl;
+
 	snapshots->CreateThumbnails();
 
-	geom.DeleteVo();
-	glfwTerminate();
+	if (useGl)
+	{
+		geom.DeleteVo();
+		shaders.Delete();
+		if (!vidIn->IsRunning())
+			frameStream.Delete(); // Unmaps the buffers the decoder writes to
+		if (window != nullptr)
+			glfwTerminate();
+		GlTerminateEgl();
+	}
 
 	PostProcess();
 	return 0;
@@ -418,7 +790,7 @@ VrRecorder::Run(VrImageFormat vrFormat)
 void 
 VrRecorder::PostProcess()
 {
-	if (c.saveaudio)
+	if (c.saveaudio && !audioInline)
 	{
 		auto ffmpegPath = c.GetString("ffmpegPath", "ffmpeg.exe");
 		std::string vpath = videopath + ".unvr.vid.mp4";
@@ -428,7 +800,6 @@ VrRecorder::PostProcess()
 		{
 			vpath = c.outPath + ".vid.mp4";
 			opath = c.outPath;
-			std::filesystem::rename(opath, vpath);
 		}
 		if (c.outFolder != "")
 		{
@@ -439,6 +810,9 @@ VrRecorder::PostProcess()
 			vpath = spath + ".unvr.vid.mp4";
 			opath = spath + ".unvr.mp4";
 		}
+		// Written under the final name, by outPath or a writer that was to copy the audio itself
+		if (vidOut->filePath != vpath && std::filesystem::exists(vidOut->filePath))
+			std::filesystem::rename(vidOut->filePath, vpath);
 
 
 		if (std::filesystem::exists(vpath))
@@ -484,6 +858,13 @@ VrRecorder::ModifyScript(bool set)
 	}
 }
 
+// Whether a paused frame must be drawn again: input happened, the camera moved, or the decoder delivered a frame
+bool
+VrRecorder::NeedsRedraw()
+{
+	return redraw || vidIn->HasFrame() || !cam.cps.SameValues(drawnCps);
+}
+
 void 
 VrRecorder::ResetView()
 {
@@ -499,7 +880,7 @@ VrRecorder::ResetView()
 void 
 VrRecorder::processInput(GLFWwindow* window)
 {
-#define ONKEY(key, code) if (glfwGetKey(window, GLFW_KEY_ ## key) == GLFW_PRESS) { lastKey = GLFW_KEY_ ## key; code; }
+#define ONKEY(key, code) if (glfwGetKey(window, GLFW_KEY_ ## key) == GLFW_PRESS) { lastKey = GLFW_KEY_ ## key; redraw = true; code; }
 
 	if (lastKey != 0 && glfwGetKey(window, lastKey) == GLFW_PRESS)
 		return;
@@ -525,7 +906,7 @@ VrRecorder::processInput(GLFWwindow* window)
 	}
 	else // normal mode
 	{
-		ONKEY(ESCAPE, vidIn->Close(); vidOut->Close(); glfwSetWindowShouldClose(window, true); );
+		ONKEY(ESCAPE, glfwSetWindowShouldClose(window, true); ); // Run closes the input and output when its loop ends
 		ONKEY(SPACE, pause = !pause;);
 	}
 
@@ -582,10 +963,8 @@ void
 VrRecorder::framebuffer_size_callback(GLFWwindow* window, int width, int height) 
 {
 	if (width > 0 && height > 0)
-	{
 		scrSize = cv::Size(width, height); 
-		rtUv.SetSize(width, height);
-	}
+	redraw = true;
 }
 
 void
@@ -616,6 +995,7 @@ VrRecorder::scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 void 
 VrRecorder::button_callback(GLFWwindow* window, int button, int action, int mods)
 {
+	redraw = true;
 	if (action == GLFW_PRESS && button == GLFW_MOUSE_BUTTON_2)
 	{
 		isScriptYpChanged = isScriptFbChanged = false;
@@ -624,16 +1004,17 @@ VrRecorder::button_callback(GLFWwindow* window, int button, int action, int mods
 
 	if (action == GLFW_PRESS && button == GLFW_MOUSE_BUTTON_1)
 	{
-		cv::Mat uvMap = GetViewUv();
-		cv::Vec2w v = uvMap.at<cv::Vec2w>(cv::Point((int)lastX, (int)lastY));
-		float su = v[0];
-		float sv = v[1];
-		if (su != 0 && sv != 0)
+		// Follow the ray under the cursor to the point it hits on the image, as rt projects it. The window shows rt scaled
+		cv::Rect sr = rt.ScreenRect(scrSize.width, scrSize.height);
+		float x = (lastX - sr.x) * rt.renderWidth / std::max(1, sr.width);
+		float y = (lastY - sr.y) * rt.renderHeight / std::max(1, sr.height);
+		CpuProjection proj;
+		proj.Set(cam, geom, rt.renderWidth, rt.renderHeight);
+		glm::vec3 p;
+		glm::vec2 tex;
+		if (proj.Intersect(proj.Ray(x - 0.5f, y - 0.5f), p) && proj.PointToTex(p, tex))
 		{
-			float tx = su / (256 * 256.0f);
-			float ty = sv / (256 * 256.0f);
-			auto v = geom.Tex2Dir(tx , ty);
-			auto yp = cam.CalcYawPitch(v);
+			auto yp = cam.CalcYawPitch(p);
 			float yaw = yp.Yaw;
 			float pitch = yp.Pitch;
 			if ((yaw != 0 && !isnormal(yaw)) || (pitch != 0 && !isnormal(pitch)))
@@ -10,6 +10,7 @@
 #include <GLFW/glfw3.h>
 
 #include <vector>
+#include <memory>
 #include <string>
 #include <fstream>
 #include <sstream>
@@ -23,6 +24,7 @@
 #include <opencv2/opencv.hpp>
 
 #include "blockingqueue.hpp"
+#include "pipeline.hpp"
 #include "shader.hpp"
 #include "camera.hpp"
 #include "cameratracker.hpp"
@@ -30,6 +32,8 @@
 #include "videoOutput.hpp"
 #include "snapShots.hpp"
 #include "gl_renderTarget.hpp"
+#include "gl_framestream.hpp"
+#include "cpu_rendertarget.hpp"
 #include "gl_base.hpp"
 #include "config.hpp"
 #include "vrimageformat.hpp"
@@ -53,6 +57,7 @@ private:
 
 	VideoInput* vidIn;
 	VideoOutput* vidOut;
+	bool audioInline = false; // The output writer copies the source audio, see StartNormalMode
 	VideoFrame* curframe = nullptr;
 	TimeCode curTimeCode;
 	Script script;
@@ -61,7 +66,39 @@ private:
 
 	Camera cam;
 	CameraTracker camTracker;
-	GlRenderTarget rt, rtUv;
+	GlRenderTarget rt;
+
+	// Extra output rendered from the same uploaded frames as the main view, see Views in config
+	struct View
+	{
+		std::string name;
+		bool track = false; // Follows the tracker like the main view, else stays where it was set
+		Camera cam;
+		GlRenderTarget rt;
+		VideoOutput out;
+	};
+	std::vector<std::unique_ptr<View>> views;
+
+	// Tracking runs on each frame while it is drawn, see TrackQueueDepth in config. Each VideoOutput encodes on its own thread
+	struct TrackJob
+	{
+		cv::Mat crop;
+		int frames = 1;
+		YawPitch target;
+	};
+	Pool<TrackJob> trackJobs;
+	PipelineStage<TrackJob*> track;
+	SpscRing<TrackJob*> tracked;
+	int trackPending = 0; // Jobs pushed but not taken from tracked
+	YawPitch trackTarget; // Latest tracker result
+
+	CpuRenderTarget rtCpu;
+	bool useGl = true;
+	bool yuvInput = false; // Frames are I420, sampled per plane
+	bool outI420 = false; // Render straight to I420 for the encoder
+	GlFrameStream frameStream;
+	bool uploadVisible = true; // Upload only the part of the frame the camera sees
+	CpuProjection uploadProj;
 	Geometry geom;
 	SnapShots* snapshots;
 	Marker markerYpAuto = Marker(Marker::CC::BW, Marker::Shape::Circle, 12, 2, 6);
@@ -72,10 +109,10 @@ private:
 	Marker markerFbSet = Marker(Marker::CC::BO, Marker::Shape::Box, 36, 6, 12);
 	//Marker markerFbNotSet = Marker(Marker::CC::BW, Marker::Shape::Box, 24, 2, 6);
 
-	Shader shaderN, shaderUv, shaderN2map, shaderUv2map;
-	GLFWwindow* window;
-
-	cv::Mat GetViewUv() { return rtUv.renderImg; }
+	GlShaders shaders;
+	Shader* shaderN2map = nullptr; // Render targets, the window shows rt's image
+	GLFWwindow* window = nullptr;
+	bool offscreen = false; // No visible window: no input, no screen draw, no swap
 
 	bool trgExitScriptCamMode = false;
 
@@ -86,6 +123,8 @@ private:
 	bool scriptmode = false;
 	bool showMarkers = false;
 	bool pause = false;
+	bool redraw = true; // Input since the window was last drawn, see NeedsRedraw
+	Csp drawnCps; // Camera the window was last drawn with
 	bool captMouse = false;
 	bool firstMouse = true;
 	float lastX = 0;
@@ -100,6 +139,15 @@ private:
 	void PostProcess();
 
 	bool OpenWindow();
+	bool OpenOffscreen(const std::string& api);
+	void GlInitShaders();
+	void InitViews();
+	void GlGenerateTextures(cv::Size size);
+	void UploadFrame(FrameView view);
+	void StartPipeline();
+	void FinishTracking(int keep);
+	void WriteOutput(cv::Mat& img, PixelFormat format);
+	bool NeedsRedraw();
 	void ResetView();
 	void ModifyScript(bool set);
 	void CheckScript(cv::Mat subFrame);
@@ -0,0 +1,111 @@
+//
+// Copyright (c) 2020, Jan Ove Haaland, all rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// KeyframeIndex lookup and sidecar round trip. Standalone, see Tests in README.md
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <filesystem>
+#include "../sources/keyframeindex.hpp"
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { if (!(cond)) { std::cout << __FILE__ << ":" << __LINE__ << ": failed: " #cond << std::endl; failures++; } } while (0)
+
+static int FrameBefore(const KeyframeIndex& index, int frame)
+{
+	auto k = index.Before(frame);
+	return k == nullptr ? -1 : k->frame;
+}
+
+static void TestLookup()
+{
+	KeyframeIndex index;
+	CHECK(index.Before(0) == nullptr);
+	CHECK(index.LongestGop(100) == 0);
+
+	// Decode order, as a scan adds them
+	index.Add(60, 6000, 3000);
+	index.Add(10, 1000, 500);
+	index.Add(30, 3000, 1500);
+	index.Sort();
+	CHECK(index.keyframes.size() == 3);
+	CHECK(index.keyframes[0].frame == 10 && index.keyframes[1].frame == 30 && index.keyframes[2].frame == 60);
+
+	CHECK(FrameBefore(index, 0) == -1);
+	CHECK(FrameBefore(index, 9) == -1);
+	CHECK(FrameBefore(index, 10) == 10);
+	CHECK(FrameBefore(index, 29) == 10);
+	CHECK(FrameBefore(index, 30) == 30);
+	CHECK(FrameBefore(index, 59) == 30);
+	CHECK(FrameBefore(index, 60) == 60);
+	CHECK(FrameBefore(index, 1000) == 60);
+	CHECK(index.Before(45)->pts == 3000 && index.Before(45)->pos == 1500);
+
+	CHECK(index.LongestGop(80) == 30);
+	CHECK(index.LongestGop(200) == 140);
+}
+
+static void TestSidecar()
+{
+	auto video = (std::filesystem::temp_directory_path() / "unvr_keyframeindex_test.mp4").string();
+	auto sidecar = KeyframeIndex::SidecarPath(video);
+	CHECK(sidecar == video + ".unvr.keyframes");
+	std::filesystem::remove(sidecar);
+	{
+		std::ofstream f(video, std::ios::binary);
+		f << std::string(4096, 'v');
+	}
+
+	KeyframeIndex none;
+	CHECK(!none.Load(video));
+
+	KeyframeIndex saved;
+	saved.Add(0, 0, 48);
+	saved.Add(25, 25600, 123456);
+	saved.Add(50, 51200, -1);
+	CHECK(saved.Save(video));
+
+	KeyframeIndex loaded;
+	CHECK(loaded.Load(video));
+	CHECK(loaded.keyframes.size() == saved.keyframes.size());
+	for (size_t i = 0; i < loaded.keyframes.size() && i < saved.keyframes.size(); i++)
+	{
+		CHECK(loaded.keyframes[i].frame == saved.keyframes[i].frame);
+		CHECK(loaded.keyframes[i].pts == saved.keyframes[i].pts);
+		CHECK(loaded.keyframes[i].pos == saved.keyframes[i].pos);
+	}
+	CHECK(FrameBefore(loaded, 30) == 25);
+
+	// A changed video makes the sidecar stale
+	{
+		std::ofstream f(video, std::ios::binary | std::ios::app);
+		f << "more";
+	}
+	KeyframeIndex stale;
+	CHECK(!stale.Load(video));
+
+	// So does a sidecar from another format version
+	CHECK(saved.Save(video));
+	{
+		std::ofstream f(sidecar);
+		f << "unvr keyframes 0" << std::endl;
+	}
+	CHECK(!stale.Load(video));
+
+	std::filesystem::remove(sidecar);
+	std::filesystem::remove(video);
+}
+
+int main()
+{
+	TestLookup();
+	TestSidecar();
+	std::cout << (failures == 0 ? "KeyframeIndex: ok" : "KeyframeIndex: failed") << std::endl;
+	return failures == 0 ? 0 : 1;
+}